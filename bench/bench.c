@@ -0,0 +1,310 @@
+/* Cost of a scope with defers against the hand-written alternatives.
+ *
+ * Every case times one "operation": enter a scope, register some defers on
+ * it, leave it and run them, nested to the given depth.  The cleanup is the
+ * same out-of-line increment for every implementation, except for the lock_*
+ * cases where it is releasing an uncontended mutex taken for it.  Each case
+ * runs with the thread's stack kept from going empty by a scope pushed by hand
+ * ("stack") and by the automatic root scope ("auto").  Output is one CSV row
+ * per case on stdout.
+ *
+ * usage: defer_bench [-q] [-m milliseconds per case] [-t max threads]
+ */
+#define _GNU_SOURCE
+#include <defer.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef DEFER_INLINE
+#define IMPL "inline"
+#else
+#define IMPL "library"
+#endif
+
+#define NOINLINE __attribute__((noinline))
+
+static NOINLINE void sink(void* p) {
+    ++*(volatile long*)p;
+}
+
+static _Thread_local long noarg_ctr;
+static NOINLINE void sink_noarg(void) {
+    ++*(volatile long*)&noarg_ctr;
+}
+
+static NOINLINE void sink_cleanup(long** p) {
+    sink(*p);
+}
+
+static NOINLINE void sink_noarg_cleanup(long** p) {
+    (void)p;
+    sink_noarg();
+}
+
+static NOINLINE void nop(void* p) {
+    (void)p;
+}
+
+typedef void (*op_fn)(int depth, int defers, long* c);
+
+/* goto cleanup, the cleanup count is known at the label */
+#define GOTO_OP(NAME, CLEANUP)                                      \
+    static NOINLINE void NAME(int depth, int defers, long* c) {     \
+        int registered = 0;                                         \
+        for (; registered < defers; ++registered)                   \
+            __asm__ volatile("" ::: "memory");                      \
+        if (depth > 1)                                              \
+            NAME(depth - 1, defers, c);                             \
+        goto out;                                                   \
+    out:                                                            \
+        while (registered--)                                        \
+            CLEANUP;                                                \
+    }
+GOTO_OP(op_goto, sink(c))
+GOTO_OP(op_goto_noarg, sink_noarg())
+
+/* __attribute__((cleanup)), needs the defer count at compile time */
+#define CLEANUP_VAR(F, N) long* v##N __attribute__((cleanup(F))) = c;
+#define CLEANUP_4(F, N)                                         \
+    CLEANUP_VAR(F, N##0) CLEANUP_VAR(F, N##1) CLEANUP_VAR(F, N##2) \
+        CLEANUP_VAR(F, N##3)
+#define CLEANUP_16(F, N) \
+    CLEANUP_4(F, N##0) CLEANUP_4(F, N##1) CLEANUP_4(F, N##2) CLEANUP_4(F, N##3)
+
+#define CLEANUP_OP(NAME, K, VARS)                               \
+    static NOINLINE void NAME##_##K(int depth, long* c) {       \
+        VARS;                                                   \
+        if (depth > 1)                                          \
+            NAME##_##K(depth - 1, c);                           \
+    }
+
+#define CLEANUP_OPS(NAME, F)                                             \
+    CLEANUP_OP(NAME, 1, CLEANUP_VAR(F, 0))                               \
+    CLEANUP_OP(NAME, 4, CLEANUP_4(F, 0))                                 \
+    CLEANUP_OP(NAME, 16, CLEANUP_16(F, 0))                               \
+    CLEANUP_OP(NAME, 64, CLEANUP_16(F, 0) CLEANUP_16(F, 1)               \
+                             CLEANUP_16(F, 2) CLEANUP_16(F, 3))          \
+    static NOINLINE void NAME(int depth, int defers, long* c) {          \
+        switch (defers) {                                                \
+            case 1:                                                      \
+                NAME##_1(depth, c);                                      \
+                break;                                                   \
+            case 4:                                                      \
+                NAME##_4(depth, c);                                      \
+                break;                                                   \
+            case 16:                                                     \
+                NAME##_16(depth, c);                                     \
+                break;                                                   \
+            case 64:                                                     \
+                NAME##_64(depth, c);                                     \
+                break;                                                   \
+        }                                                                \
+    }
+CLEANUP_OPS(op_cleanup, sink_cleanup)
+CLEANUP_OPS(op_cleanup_noarg, sink_noarg_cleanup)
+
+DEFER_SCOPED_VOID(op_scoped, (int, depth, int, defers, long*, c)) {
+    for (int i = 0; i < defers; ++i)
+        defer(sink, c);
+    if (depth > 1)
+        op_scoped(depth - 1, defers, c);
+}
+
+DSNEV(op_dsne, (int, depth, int, defers, long*, c)) {
+    for (int i = 0; i < defers; ++i)
+        defer(sink, c);
+    if (depth > 1)
+        op_dsne(depth - 1, defers, c);
+}
+
+DSNEV(op_dsne_noarg, (int, depth, int, defers, long*, c)) {
+    for (int i = 0; i < defers; ++i)
+        defer_noarg(sink_noarg);
+    if (depth > 1)
+        op_dsne_noarg(depth - 1, defers, c);
+}
+
+/* A mutex per defer at every depth, per thread so they stay uncontended */
+static _Thread_local pthread_mutex_t bench_locks[16][64];
+
+static NOINLINE void unlock_cleanup(void* m) {
+    pthread_mutex_unlock((pthread_mutex_t*)m);
+}
+
+static NOINLINE void op_lock_goto(int depth, int defers, long* c) {
+    pthread_mutex_t* locks = bench_locks[depth - 1];
+    int locked = 0;
+    for (; locked < defers; ++locked)
+        pthread_mutex_lock(&locks[locked]);
+    if (depth > 1)
+        op_lock_goto(depth - 1, defers, c);
+    goto out;
+out:
+    while (locked--)
+        pthread_mutex_unlock(&locks[locked]);
+}
+
+DSNEV(op_lock_defer, (int, depth, int, defers, long*, c)) {
+    pthread_mutex_t* locks = bench_locks[depth - 1];
+    for (int i = 0; i < defers; ++i) {
+        pthread_mutex_lock(&locks[i]);
+        defer(unlock_cleanup, &locks[i]);
+    }
+    if (depth > 1)
+        op_lock_defer(depth - 1, defers, c);
+}
+
+DSNEV(op_lock_guard, (int, depth, int, defers, long*, c)) {
+    pthread_mutex_t* locks = bench_locks[depth - 1];
+    for (int i = 0; i < defers; ++i)
+        defer_lock(&locks[i]);
+    if (depth > 1)
+        op_lock_guard(depth - 1, defers, c);
+}
+
+static const struct {
+    const char* name;
+    op_fn op;
+} variants[] = {
+    {"goto", op_goto},
+    {"cleanup_attr", op_cleanup},
+    {"defer_scoped", op_scoped},
+    {"dsne", op_dsne},
+    {"goto_noarg", op_goto_noarg},
+    {"cleanup_attr_noarg", op_cleanup_noarg},
+    {"dsne_noarg", op_dsne_noarg},
+    {"lock_goto", op_lock_goto},
+    {"lock_defer", op_lock_defer},
+    {"lock_guard", op_lock_guard},
+};
+
+static const char* const roots[] = {"stack", "auto"};
+static const int depths[] = {1, 4, 16};
+static const int defer_counts[] = {1, 4, 16, 64};
+
+struct run {
+    op_fn op;
+    bool auto_root;
+    int depth;
+    int defers;
+    long iterations;
+    pthread_barrier_t* start;
+    double ns;
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void* run_thread(void* arg) {
+    struct run* r = (struct run*)arg;
+    long c = 0;
+    for (int d = 0; d < 16; ++d)
+        for (int i = 0; i < 64; ++i)
+            pthread_mutex_init(&bench_locks[d][i], NULL);
+    // keep the thread's stack from going empty between operations, either by
+    // hand or with the root scope deferring with no scope pushed creates,
+    // which stays until the thread exits
+    defer_scope_t root[1];
+    if (r->auto_root)
+        defer(nop, NULL);
+    else
+        defer_scope_push(defer_scope_init(root));
+    pthread_barrier_wait(r->start);
+    double t0 = now_ns();
+    for (long i = 0; i < r->iterations; ++i)
+        r->op(r->depth, r->defers, &c);
+    r->ns = now_ns() - t0;
+    if (!r->auto_root)
+        defer_scope_pop(root);
+    return NULL;
+}
+
+/* Run op on nthreads threads at once, returning the mean ns per operation */
+static double measure(op_fn op,
+                      bool auto_root,
+                      int depth,
+                      int defers,
+                      int nthreads,
+                      long its) {
+    pthread_t threads[nthreads];
+    struct run runs[nthreads];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, nthreads);
+    for (int t = 0; t < nthreads; ++t) {
+        runs[t] = (struct run){op, auto_root, depth, defers, its, &start, 0};
+        pthread_create(&threads[t], NULL, run_thread, &runs[t]);
+    }
+    double total = 0;
+    for (int t = 0; t < nthreads; ++t) {
+        pthread_join(threads[t], NULL);
+        total += runs[t].ns;
+    }
+    pthread_barrier_destroy(&start);
+    return total / nthreads / its;
+}
+
+int main(int argc, char* argv[]) {
+    double budget_ms = 50;
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "qm:t:")) != -1) {
+        switch (opt) {
+            case 'q':
+                budget_ms = 0.1;
+                max_threads = 2;
+                break;
+            case 'm':
+                budget_ms = atof(optarg);
+                break;
+            case 't':
+                max_threads = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-q] [-m ms] [-t threads]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (max_threads < 1)
+        max_threads = 1;
+
+    // powers of two up to, and always including, max_threads
+    long thread_counts[64];
+    int nthread_counts = 0;
+    for (long t = 1; t < max_threads && nthread_counts < 63; t *= 2)
+        thread_counts[nthread_counts++] = t;
+    thread_counts[nthread_counts++] = max_threads;
+
+    printf("impl,variant,root,depth,defers,threads,iterations,ns_per_op,"
+           "ns_per_defer\n");
+    for (size_t v = 0; v < sizeof variants / sizeof *variants; ++v)
+        for (int a = 0; a < 2; ++a)
+            for (size_t d = 0; d < sizeof depths / sizeof *depths; ++d)
+                for (size_t n = 0;
+                     n < sizeof defer_counts / sizeof *defer_counts; ++n) {
+                    int depth = depths[d], defers = defer_counts[n];
+                    // calibrate the iteration count single threaded
+                    double ns =
+                        measure(variants[v].op, a, depth, defers, 1, 1000);
+                    long its = budget_ms * 1e6 / (ns > 1 ? ns : 1);
+                    if (its < 1)
+                        its = 1;
+                    for (int t = 0; t < nthread_counts; ++t) {
+                        ns = measure(variants[v].op, a, depth, defers,
+                                     thread_counts[t], its);
+                        printf("%s,%s,%s,%d,%d,%ld,%ld,%.2f,%.3f\n", IMPL,
+                               variants[v].name, roots[a], depth, defers,
+                               thread_counts[t], its, ns,
+                               ns / (depth * defers));
+                    }
+                }
+    return 0;
+}
@@ -1,22 +1,85 @@
+#define __DEFER_LIBRARY
 #include "defer.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
-struct defer {
-    struct defer* next;
-    union {
-        deferable_free_like fn;
-        deferable_noarg noarg;
-    };
-    void* data;
-    bool arg;
+/* See __DEFER_LAYOUT, only the layout this library was built with exists */
+const char __DEFER_LAYOUT = 0;
+
+#ifndef DEFER_BLOCK_ENTRIES
+#define DEFER_BLOCK_ENTRIES 30
+#endif
+
+/* Overflow storage for scopes whose inline routines are full, chained newest
+ * first off of defer_scope_t.overflow */
+typedef struct defer_block {
+    struct defer_block* next;
+    size_t count;
+    defer_t entries[DEFER_BLOCK_ENTRIES];
+} defer_block_t;
+
+#if __STDC_VERSION__ >= 201112L
+_Static_assert(DEFER_PAYLOAD_MAX < (DEFER_BLOCK_ENTRIES - 1) * sizeof(defer_t),
+               "DEFER_PAYLOAD_MAX must fit in an overflow block");
+// detach_entries moves a scope's inline entries into a single block
+_Static_assert(DEFER_SCOPE_INLINE <= DEFER_BLOCK_ENTRIES,
+               "DEFER_SCOPE_INLINE must fit in an overflow block");
+#endif
+
+/* Entry of a DEFER_SCOPE_CONCURRENT scope, pushed lock-free onto
+ * defer_scope_t.shared by whichever thread registers it */
+typedef struct defer_node {
+    struct defer_node* next;
+    defer_t entry;
+} defer_node_t;
+
+/* Argument array of a DEFER_KIND_MANY entry, allocated in one piece */
+struct defer_many {
+    size_t count;
+    void* args[];
 };
 
+#ifndef DEFER_ARENA_CHUNK
+#define DEFER_ARENA_CHUNK 4096
+#endif
+
+/* Chunk of a scope's arena, sizes in units of the strictest alignment malloc
+ * provides */
+typedef union {
+    long double ld;
+    long long ll;
+    void* p;
+    void (*fn)(void);
+} defer_align_t;
+
+typedef struct defer_chunk {
+    struct defer_chunk* next;
+    size_t used;
+    size_t size;
+    defer_align_t data[];
+} defer_chunk_t;
+
+#define ARENA_UNITS \
+    ((DEFER_ARENA_CHUNK - sizeof(defer_chunk_t)) / sizeof(defer_align_t))
+/* cached chunks count against the cache limit at their size in blocks */
+#define ARENA_CHUNK_BLOCKS \
+    ((DEFER_ARENA_CHUNK + sizeof(defer_block_t) - 1) / sizeof(defer_block_t))
+
+#ifndef DEFER_CACHE_LIMIT
+#define DEFER_CACHE_LIMIT 8
+#endif
+
 static pthread_once_t dss_init_once = PTHREAD_ONCE_INIT;
 
 #if __STDC_VERSION__ >= 201112L
@@ -39,69 +102,1497 @@ static inline void set_dss(defer_scope_t* new) {
 
 #endif  //__STDC_VERSION__ >= 201112L
 
-static void execute_all_deferred(void* dscope /* defer_scope_t * */);
+#if USE_THREAD_LOCAL
+#define DEFER_TLS _Thread_local
+#else
+#define DEFER_TLS __thread
+#endif
+
+/* Per-thread freelist of overflow blocks and concurrent scope nodes, steady
+ * state defer/pop should never touch the heap.  Nodes count against the limit
+ * at DEFER_BLOCK_ENTRIES per block.  The key only exists to release the cache
+ * on thread exit. */
+struct defer_cache {
+    defer_block_t* free;
+    size_t count;
+    defer_node_t* nodes;
+    size_t node_count;
+    defer_chunk_t* chunks;
+    size_t chunk_count;
+    size_t limit;
+    bool armed;
+};
+static DEFER_TLS struct defer_cache defer_node_cache = {
+    NULL, 0, NULL, 0, NULL, 0, DEFER_CACHE_LIMIT, false};
+static pthread_key_t defer_cache_key;
+
+static size_t trim_cache(struct defer_cache* c, size_t keep) {
+    size_t freed = 0;
+    while (c->count > keep) {
+        defer_block_t* tmp = c->free;
+        c->free = tmp->next;
+        c->count--;
+        free(tmp);
+        freed++;
+    }
+    while (c->node_count > keep * DEFER_BLOCK_ENTRIES) {
+        defer_node_t* tmp = c->nodes;
+        c->nodes = tmp->next;
+        c->node_count--;
+        free(tmp);
+        freed++;
+    }
+    while (c->chunk_count * ARENA_CHUNK_BLOCKS > keep) {
+        defer_chunk_t* tmp = c->chunks;
+        c->chunks = tmp->next;
+        c->chunk_count--;
+        free(tmp);
+        freed++;
+    }
+    return freed;
+}
+
+/* Blocks of exited threads, handed to threads whose caches run dry so that
+ * pools with thread churn do not go back to malloc for every new thread.
+ * Concurrent scope nodes go through here too: workers take them from their
+ * own cache but the popping thread puts them back into its own, so its
+ * surplus comes here, in runs of DEFER_BLOCK_ENTRIES, for the workers to
+ * refill from. */
+#ifndef DEFER_DEPOT_LIMIT
+#define DEFER_DEPOT_LIMIT 64
+#endif
+
+static struct {
+    pthread_mutex_t lock;
+    defer_block_t* blocks;
+    size_t count;
+    defer_node_t* nodes;
+    size_t node_count;
+} defer_depot = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0};
+
+static void depot_put(struct defer_cache* c) {
+    pthread_mutex_lock(&defer_depot.lock);
+    size_t count = defer_depot.count;
+    while (c->free && count < DEFER_DEPOT_LIMIT) {
+        defer_block_t* b = c->free;
+        c->free = b->next;
+        c->count--;
+        b->next = defer_depot.blocks;
+        defer_depot.blocks = b;
+        count++;
+    }
+    __atomic_store_n(&defer_depot.count, count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&defer_depot.lock);
+}
+
+/* Refill the empty cache c with up to half its limit from the depot */
+static void depot_take(struct defer_cache* c) {
+    if (!__atomic_load_n(&defer_depot.count, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&defer_depot.lock);
+    size_t count = defer_depot.count;
+    size_t want = c->limit / 2 ? c->limit / 2 : 1;
+    while (defer_depot.blocks && want--) {
+        defer_block_t* b = defer_depot.blocks;
+        defer_depot.blocks = b->next;
+        b->next = c->free;
+        c->free = b;
+        c->count++;
+        count--;
+    }
+    __atomic_store_n(&defer_depot.count, count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&defer_depot.lock);
+}
+
+/* Move up to want nodes from c to the depot, spliced in under one lock */
+static void depot_put_nodes(struct defer_cache* c, size_t want) {
+    defer_node_t* head = c->nodes;
+    if (!head)
+        return;
+    pthread_mutex_lock(&defer_depot.lock);
+    size_t room = DEFER_DEPOT_LIMIT * DEFER_BLOCK_ENTRIES -
+                  defer_depot.node_count;
+    if (want > room)
+        want = room;
+    if (want) {
+        defer_node_t* tail = head;
+        size_t moved = 1;
+        for (; moved < want && tail->next; moved++)
+            tail = tail->next;
+        c->nodes = tail->next;
+        c->node_count -= moved;
+        tail->next = defer_depot.nodes;
+        defer_depot.nodes = head;
+        __atomic_store_n(&defer_depot.node_count,
+                         defer_depot.node_count + moved, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&defer_depot.lock);
+}
+
+/* Refill the empty node cache of c with a run of nodes from the depot */
+static void depot_take_nodes(struct defer_cache* c) {
+    if (!__atomic_load_n(&defer_depot.node_count, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&defer_depot.lock);
+    defer_node_t* head = defer_depot.nodes;
+    if (head) {
+        defer_node_t* tail = head;
+        size_t moved = 1;
+        for (; moved < DEFER_BLOCK_ENTRIES && tail->next; moved++)
+            tail = tail->next;
+        defer_depot.nodes = tail->next;
+        __atomic_store_n(&defer_depot.node_count,
+                         defer_depot.node_count - moved, __ATOMIC_RELAXED);
+        tail->next = c->nodes;
+        c->nodes = head;
+        c->node_count += moved;
+    }
+    pthread_mutex_unlock(&defer_depot.lock);
+}
+
+/* Thread exit, or process exit for the main thread, blocks and nodes go to
+ * the depot */
+static void release_cache(void* cache /* struct defer_cache * */) {
+    struct defer_cache* c = (struct defer_cache*)cache;
+    depot_put(c);
+    depot_put_nodes(c, c->node_count);
+    trim_cache(c, 0);
+    // anything cached from here on, by later destructors, has to re-arm
+    c->armed = false;
+}
+
+static inline void arm_cache(struct defer_cache* c) {
+    if (!c->armed) {
+        // first allocation cached on this thread, arm the exit destructor
+        pthread_setspecific(defer_cache_key, c);
+        c->armed = true;
+    }
+}
+
+static inline defer_block_t* block_get(void) {
+    struct defer_cache* c = &defer_node_cache;
+    if (!c->free)
+        depot_take(c);
+    defer_block_t* b = c->free;
+    if (b) {
+        c->free = b->next;
+        c->count--;
+    } else {
+        b = (defer_block_t*)malloc(sizeof *b);
+    }
+    b->count = 0;
+    return b;
+}
+
+static inline void block_put(defer_block_t* d) {
+    struct defer_cache* c = &defer_node_cache;
+    if (c->count >= c->limit) {
+        free(d);
+        return;
+    }
+    arm_cache(c);
+    d->next = c->free;
+    c->free = d;
+    c->count++;
+}
+
+static inline defer_node_t* node_get(void) {
+    struct defer_cache* c = &defer_node_cache;
+    if (!c->nodes) {
+        depot_take_nodes(c);
+        if (c->nodes)
+            arm_cache(c);
+    }
+    defer_node_t* n = c->nodes;
+    if (n) {
+        c->nodes = n->next;
+        c->node_count--;
+        return n;
+    }
+    return (defer_node_t*)malloc(sizeof *n);
+}
+
+static inline void node_put(defer_node_t* n) {
+    struct defer_cache* c = &defer_node_cache;
+    if (c->node_count >= c->limit * DEFER_BLOCK_ENTRIES)
+        depot_put_nodes(c, DEFER_BLOCK_ENTRIES);
+    if (c->node_count >= c->limit * DEFER_BLOCK_ENTRIES) {
+        free(n);
+        return;
+    }
+    arm_cache(c);
+    n->next = c->nodes;
+    c->nodes = n;
+    c->node_count++;
+}
+
+static inline defer_chunk_t* chunk_get(size_t units) {
+    struct defer_cache* c = &defer_node_cache;
+    defer_chunk_t* k = c->chunks;
+    if (k && units <= ARENA_UNITS) {
+        c->chunks = k->next;
+        c->chunk_count--;
+    } else {
+        size_t size = units > ARENA_UNITS ? units : ARENA_UNITS;
+        k = (defer_chunk_t*)malloc(sizeof *k + size * sizeof *k->data);
+        if (!k)
+            return NULL;
+        k->size = size;
+    }
+    k->used = 0;
+    return k;
+}
+
+/* Release a whole chain of chunks */
+static void chunk_put(defer_chunk_t* k) {
+    struct defer_cache* c = &defer_node_cache;
+    while (k) {
+        defer_chunk_t* next = k->next;
+        if (k->size == ARENA_UNITS &&
+            (c->chunk_count + 1) * ARENA_CHUNK_BLOCKS <= c->limit) {
+            arm_cache(c);
+            k->next = c->chunks;
+            c->chunks = k;
+            c->chunk_count++;
+        } else {
+            free(k);
+        }
+        k = next;
+    }
+}
+
+#ifdef DEFER_STATS
+
+/* Per-thread counters, written only by their own thread but with relaxed
+ * atomics so defer_stats_snapshot can read them from anywhere.  Threads
+ * register on first use and fold their counts into the retired totals when
+ * they exit. */
+struct defer_thread_stats {
+    struct defer_thread_stats* next;
+    struct defer_thread_stats** prev;
+    uint64_t depth;
+    defer_stats_t s;
+};
+
+static DEFER_TLS struct defer_thread_stats defer_stats_local;
+static DEFER_TLS bool defer_stats_registered;
+static pthread_mutex_t defer_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct defer_thread_stats* defer_stats_threads;
+static defer_stats_t defer_stats_retired;
+static pthread_key_t defer_stats_key;
+static pthread_once_t defer_stats_once = PTHREAD_ONCE_INIT;
+
+#define STAT_LOAD(F) __atomic_load_n(&(F), __ATOMIC_RELAXED)
+
+static inline void stat_add(uint64_t* f, uint64_t n) {
+    __atomic_store_n(f, STAT_LOAD(*f) + n, __ATOMIC_RELAXED);
+}
+
+static inline void stat_max(uint64_t* f, uint64_t v) {
+    if (v > STAT_LOAD(*f))
+        __atomic_store_n(f, v, __ATOMIC_RELAXED);
+}
+
+static void stats_merge(defer_stats_t* into, defer_stats_t* from) {
+    into->defers += STAT_LOAD(from->defers);
+    into->pushes += STAT_LOAD(from->pushes);
+    into->pops += STAT_LOAD(from->pops);
+    if (STAT_LOAD(from->max_depth) > into->max_depth)
+        into->max_depth = STAT_LOAD(from->max_depth);
+    if (STAT_LOAD(from->largest_scope) > into->largest_scope)
+        into->largest_scope = STAT_LOAD(from->largest_scope);
+    for (int i = 0; i < DEFER_STATS_BUCKETS; ++i)
+        into->pop_ns[i] += STAT_LOAD(from->pop_ns[i]);
+}
+
+/* Fold t into the retired totals and take it off the list.  Runs from both
+ * thread_exit, once the root scope is unwound, and the key's destructor, in
+ * whichever order, anything counted in between registers the thread again
+ * and is folded in by a later destructor round. */
+static void stats_retire(struct defer_thread_stats* t) {
+    if (!defer_stats_registered)
+        return;
+    pthread_mutex_lock(&defer_stats_lock);
+    stats_merge(&defer_stats_retired, &t->s);
+    *t->prev = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    pthread_mutex_unlock(&defer_stats_lock);
+    memset(&t->s, 0, sizeof t->s);
+    defer_stats_registered = false;
+}
+
+static void stats_thread_exit(void* stats /* struct defer_thread_stats * */) {
+    stats_retire((struct defer_thread_stats*)stats);
+}
+
+static void stats_init(void) {
+    pthread_key_create(&defer_stats_key, stats_thread_exit);
+}
+
+static struct defer_thread_stats* stats_self(void) {
+    struct defer_thread_stats* t = &defer_stats_local;
+    if (!defer_stats_registered) {
+        pthread_once(&defer_stats_once, stats_init);
+        pthread_mutex_lock(&defer_stats_lock);
+        t->next = defer_stats_threads;
+        t->prev = &defer_stats_threads;
+        if (t->next)
+            t->next->prev = &t->next;
+        defer_stats_threads = t;
+        pthread_mutex_unlock(&defer_stats_lock);
+        pthread_setspecific(defer_stats_key, t);
+        defer_stats_registered = true;
+    }
+    return t;
+}
+
+static inline uint64_t stat_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void stat_pop_ns(uint64_t ns) {
+    int bucket = 0;
+    while (ns > 1 && bucket < DEFER_STATS_BUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    stat_add(&stats_self()->s.pop_ns[bucket], 1);
+}
+
+static void stat_push(void) {
+    struct defer_thread_stats* t = stats_self();
+    stat_add(&t->s.pushes, 1);
+    stat_max(&t->s.max_depth, ++t->depth);
+}
+
+static void stat_pop(size_t entries) {
+    struct defer_thread_stats* t = stats_self();
+    stat_add(&t->s.pops, 1);
+    stat_max(&t->s.largest_scope, entries);
+    if (t->depth)
+        t->depth--;
+}
+
+/* The tracked depth follows the stack defer_stack_swap switched to */
+static void stat_rebase(defer_scope_t* top) {
+    uint64_t depth = 0;
+    for (; top; top = top->parent)
+        depth++;
+    stats_self()->depth = depth;
+}
+
+#define STAT_DEFER() stat_add(&stats_self()->s.defers, 1)
+#define STAT_PUSH() stat_push()
+#define STAT_POP(ENTRIES) stat_pop(ENTRIES)
+#define STAT_UNLINK() (stats_self()->depth--)
+#define STAT_REBASE(TOP) stat_rebase(TOP)
+#define STAT_COUNT(D, N) count_entries(D, N)
+#define STAT_THREAD_EXIT() stats_retire(&defer_stats_local)
+#define STAT_TIMER_START() uint64_t stat_t0 = stat_now()
+#define STAT_TIMER_END() stat_pop_ns(stat_now() - stat_t0)
+
+#else  // DEFER_STATS
+
+#define STAT_DEFER() ((void)0)
+#define STAT_PUSH() ((void)0)
+#define STAT_POP(ENTRIES) ((void)(ENTRIES))
+#define STAT_UNLINK() ((void)0)
+#define STAT_REBASE(TOP) ((void)0)
+#define STAT_COUNT(D, N) 0
+#define STAT_THREAD_EXIT() ((void)0)
+#define STAT_TIMER_START() ((void)0)
+#define STAT_TIMER_END() ((void)0)
+
+#endif  // DEFER_STATS
+
+bool defer_stats_snapshot(defer_stats_t* out) {
+    memset(out, 0, sizeof *out);
+#ifdef DEFER_STATS
+    pthread_mutex_lock(&defer_stats_lock);
+    stats_merge(out, &defer_stats_retired);
+    for (struct defer_thread_stats* t = defer_stats_threads; t; t = t->next)
+        stats_merge(out, &t->s);
+    pthread_mutex_unlock(&defer_stats_lock);
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef DEFER_TRACE
+
+/* Site of the next defer registered by this thread, set by the registration
+ * macros in defer.h and consumed by defer_add */
+DEFER_TLS const defer_site_t* __defer_next_site = NULL;
+
+static const defer_hooks_t* defer_hooks = NULL;
+static const defer_site_t defer_unknown_site = {"?", 0, "?", "?"};
+
+/* Guards the Chrome trace writer, up here for the fork handlers */
+static pthread_mutex_t chrome_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void trace_take(defer_t* e) {
+    e->site = __defer_next_site;
+    __defer_next_site = NULL;
+}
+
+#define TRACE_TAKE(E) trace_take(E)
+// a registration that defers nothing must not leave its site to the next one
+#define TRACE_DROP() (__defer_next_site = NULL)
+
+#else  // DEFER_TRACE
+
+#define TRACE_TAKE(E) ((void)0)
+#define TRACE_DROP() ((void)0)
+
+#endif  // DEFER_TRACE
+
+static void thread_exit(void* top /* defer_scope_t * */);
 
 static void final_cleanup(void);
 
+static inline defer_scope_t* current_scope(void);
+
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+
+#if USE_THREAD_LOCAL
+/* Only there to run thread_exit, set once a thread first pushes a scope */
+static pthread_key_t defer_exit_key;
+static DEFER_TLS bool defer_exit_armed = false;
+#endif
+
+/* Whether this thread takes part in grace periods, see defer_after_grace.
+ * Exported for the inline pop, which must leave the outermost scope to the
+ * library on such threads.  The key only exists to unregister on thread
+ * exit. */
+DEFER_TLS bool __defer_grace_reader = false;
+static pthread_key_t defer_grace_key;
+static void grace_exit(void* unused);
+
+/* The thread's root scope, pushed when something is deferred with no scope
+ * on the stack.  live while it is on a stack, this one or a swapped out one */
+static DEFER_TLS defer_scope_t defer_root;
+static DEFER_TLS bool defer_root_live = false;
+
 static void init_dss(void) {
 #if !USE_THREAD_LOCAL
-    pthread_key_create(&defer_scope_stack, execute_all_deferred);
+    pthread_key_create(&defer_scope_stack, thread_exit);
     pthread_setspecific(defer_scope_stack, 0);
+#else
+    pthread_key_create(&defer_exit_key, thread_exit);
 #endif
+    pthread_key_create(&defer_cache_key, release_cache);
+    pthread_key_create(&defer_grace_key, grace_exit);
+    // the one registration for the whole process, see fork_child
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
 
     atexit(final_cleanup);
 }
 
-static inline void execute_deferred(defer_t* d) {
-    while (d) {
-        if (!d->fn) {
+/* Run the entry e, returning the number of payload slots below it that belong
+ * to it and must be skipped */
+static inline size_t run_entry_raw(defer_t* e) {
+    switch (e->kind & DEFER_KIND_MASK) {
+        case DEFER_KIND_NONE:
+            return e->size;
+        case DEFER_KIND_ARG:
+            e->fn(e->data);
+            break;
+        case DEFER_KIND_NOARG:
+            e->noarg();
+            break;
+        case DEFER_KIND_MANY: {
+            struct defer_many* m = (struct defer_many*)e->data;
+            deferable_free_like fn = e->fn;
+            for (size_t i = m->count; i--;)
+                fn(m->args[i]);
+            free(m);
+            break;
+        }
+        case DEFER_KIND_PAYLOAD:
+            e->fn(e - e->size);
+            return e->size;
+        case DEFER_KIND_PAYLOAD_HEAP:
+            e->fn(e->data);
+            free(e->data);
+            break;
+        case DEFER_KIND_MUTEX:
+            pthread_mutex_unlock((pthread_mutex_t*)e->data);
+            break;
+        case DEFER_KIND_RWLOCK:
+            pthread_rwlock_unlock((pthread_rwlock_t*)e->data);
+            break;
+        case DEFER_KIND_CLOSE:
+            close((int)(intptr_t)e->data);
+            break;
+        case DEFER_KIND_MUNMAP:
+            munmap(e->data, e->len);
+            break;
+        case DEFER_KIND_UNLINK:
+            unlink((const char*)e->data);
+            break;
+        default:
             fprintf(stderr, "Invalid defer encountered, aborting\n");
             abort();
+    }
+    return 0;
+}
+
+static inline size_t run_entry(defer_t* e) {
+#ifdef DEFER_TRACE
+    const defer_hooks_t* h = __atomic_load_n(&defer_hooks, __ATOMIC_ACQUIRE);
+    if (h && (e->kind & DEFER_KIND_MASK) != DEFER_KIND_NONE) {
+        const defer_site_t* site = e->site ? e->site : &defer_unknown_site;
+        if (h->enter)
+            h->enter(site, h->ctx);
+        size_t skip = run_entry_raw(e);
+        if (h->exit)
+            h->exit(site, h->ctx);
+        return skip;
+    }
+#endif
+    return run_entry_raw(e);
+}
+
+size_t __defer_run_entry(defer_t* e) {
+    return run_entry(e);
+}
+
+/* Kernel resource batches.  A run of close or munmap entries with nothing
+ * else between them is submitted together, descriptors sorted so contiguous
+ * ones go to one close_range and adjacent mappings merged into one munmap.
+ * The order within a run is lost, which neither cares about. */
+#define DEFER_BATCH_MAX 64
+
+struct defer_map {
+    char* addr;
+    size_t len;
+};
+
+static void close_batch(int* fds, size_t n) {
+    for (size_t i = 1; i < n; ++i)
+        for (size_t j = i; j && fds[j - 1] > fds[j]; --j) {
+            int tmp = fds[j];
+            fds[j] = fds[j - 1];
+            fds[j - 1] = tmp;
+        }
+    for (size_t i = 0; i < n;) {
+        size_t j = i + 1;
+        while (j < n && fds[j] <= fds[j - 1] + 1)
+            j++;
+#ifdef SYS_close_range
+        // ENOSYS on older kernels, close them one by one
+        if (j - i > 1 && fds[i] >= 0 &&
+            !syscall(SYS_close_range, (unsigned)fds[i], (unsigned)fds[j - 1], 0)) {
+            i = j;
+            continue;
+        }
+#endif
+        for (; i < j; ++i)
+            close(fds[i]);
+    }
+}
+
+static void munmap_batch(struct defer_map* m, size_t n) {
+    for (size_t i = 1; i < n; ++i)
+        for (size_t j = i; j && m[j - 1].addr > m[j].addr; --j) {
+            struct defer_map tmp = m[j];
+            m[j] = m[j - 1];
+            m[j - 1] = tmp;
+        }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < n;) {
+        char* addr = m[i].addr;
+        char* end = addr + (m[i].len + page - 1) / page * page;
+        for (++i; i < n && m[i].addr == end; ++i)
+            end += (m[i].len + page - 1) / page * page;
+        munmap(addr, (size_t)(end - addr));
+    }
+}
+
+/* Run the batchable entry d[top] and as many entries of the same kind
+ * directly below it as fit in a batch, returning how many below it ran */
+static size_t run_batch(defer_t* d, size_t top) {
+    unsigned kind = d[top].kind & DEFER_KIND_MASK;
+    size_t n = 0;
+    while (n < DEFER_BATCH_MAX && n <= top &&
+           (d[top - n].kind & DEFER_KIND_MASK) == kind)
+        n++;
+    // in registration order, usually sorted already which the sort is fast on
+    defer_t* first = d + top + 1 - n;
+    if (kind == DEFER_KIND_CLOSE) {
+        int fds[DEFER_BATCH_MAX];
+        for (size_t i = 0; i < n; ++i)
+            fds[i] = (int)(intptr_t)first[i].data;
+        close_batch(fds, n);
+    } else {
+        struct defer_map maps[DEFER_BATCH_MAX];
+        for (size_t i = 0; i < n; ++i)
+            maps[i] = (struct defer_map){(char*)first[i].data, first[i].len};
+        munmap_batch(maps, n);
+    }
+    return n - 1;
+}
+
+static inline bool batchable(defer_t* e) {
+    unsigned kind = e->kind & DEFER_KIND_MASK;
+#ifdef DEFER_TRACE
+    // hooks see every entry on its own
+    if (__atomic_load_n(&defer_hooks, __ATOMIC_RELAXED))
+        return false;
+#endif
+    return kind == DEFER_KIND_CLOSE || kind == DEFER_KIND_MUNMAP;
+}
+
+static inline void execute_entries(defer_t* d, size_t count) {
+    while (count) {
+        --count;
+        if (batchable(d + count))
+            count -= run_batch(d, count);
+        else
+            count -= run_entry(d + count);
+    }
+}
+
+/* Number of payload slots below e, without running it */
+static inline size_t entry_slots(defer_t* e) {
+    unsigned kind = e->kind & DEFER_KIND_MASK;
+    return kind == DEFER_KIND_PAYLOAD || kind == DEFER_KIND_NONE ? e->size : 0;
+}
+
+/* Run only the entries whose DEFER_UNORDERED flag matches unordered */
+static void execute_pass(defer_t* d, size_t count, bool unordered) {
+    while (count) {
+        defer_t* e = d + --count;
+        if (!(e->kind & DEFER_UNORDERED) == !unordered)
+            count -= run_entry(e);
+        else
+            count -= entry_slots(e);
+    }
+}
+
+#ifdef DEFER_STATS
+/* Number of defers in the count slots at d, not counting payload slots or
+ * padding */
+static size_t count_entries(defer_t* d, size_t count) {
+    size_t entries = 0;
+    while (count) {
+        defer_t* e = d + --count;
+        if ((e->kind & DEFER_KIND_MASK) != DEFER_KIND_NONE)
+            entries++;
+        count -= entry_slots(e);
+    }
+    return entries;
+}
+#endif
+
+static void release_spare(defer_scope_t* ds) {
+    while (ds->spare) {
+        defer_block_t* b = ds->spare;
+        ds->spare = b->next;
+        block_put(b);
+    }
+}
+
+/* Whether e only releases this process's memory, see DEFER_EXIT_FAST */
+static inline bool memory_only(defer_t* e) {
+    switch (e->kind & DEFER_KIND_MASK) {
+        case DEFER_KIND_ARG:
+        case DEFER_KIND_MANY:
+            return e->fn == free || e->kind & DEFER_MEMORY;
+        case DEFER_KIND_MUNMAP:
+            return true;
+        default:
+            return e->kind & DEFER_MEMORY;
+    }
+}
+
+/* Run only the entries that are not memory_only */
+static void execute_external(defer_t* d, size_t count) {
+    while (count) {
+        defer_t* e = d + --count;
+        if (memory_only(e))
+            count -= entry_slots(e);
+        else
+            count -= run_entry(e);
+    }
+}
+
+/* Run every defer in ds, newest first, returning with DEFER_STATS the number
+ * of defers run, payload slots and padding aside.
+ * Emptied overflow blocks either go back to the thread's cache or, when keep
+ * is set, onto the scope's spare list so a scope that is cleared and refilled
+ * in a loop does not allocate. */
+static size_t execute_deferred(defer_scope_t* ds, bool keep) {
+    size_t entries = 0;
+    // the entries that made it unordered are all consumed here
+    ds->flags &= ~DEFER_SCOPE_UNORDERED;
+    if (ds->flags & DEFER_SCOPE_CONCURRENT) {
+        // the list is newest first already, nodes only hold single entries
+        defer_node_t* n =
+            __atomic_exchange_n(&ds->shared, NULL, __ATOMIC_ACQUIRE);
+        while (n) {
+            defer_node_t* next = n->next;
+            entries += STAT_COUNT(&n->entry, 1);
+            run_entry(&n->entry);
+            node_put(n);
+            n = next;
         }
-        if (d->arg) {
-            d->fn(d->data);
+        return entries;
+    }
+    // overflow blocks hold the newest entries, run them first
+    while (ds->overflow) {
+        defer_block_t* b = ds->overflow;
+        entries += STAT_COUNT(b->entries, b->count);
+        execute_entries(b->entries, b->count);
+        ds->overflow = b->next;
+        if (keep) {
+            b->next = ds->spare;
+            ds->spare = b;
         } else {
-            d->noarg();
+            block_put(b);
         }
-        defer_t* tmp = d;
-        d = d->next;
-        free(tmp);
     }
+    entries += STAT_COUNT(ds->routines, ds->count);
+    execute_entries(ds->routines, ds->count);
+    ds->count = 0;
+    if (!keep)
+        release_spare(ds);
+    // the arena goes last, any of the defers may have used it
+    chunk_put(ds->arena);
+    ds->arena = NULL;
+    return entries;
 }
 
 defer_scope_t* defer_scope_new(void) {
-    defer_scope_t* ds = (defer_scope_t*)malloc(sizeof *ds);
-    ds->parent = NULL;
-    ds->routines = NULL;
+    defer_scope_t* ds = defer_scope_init((defer_scope_t*)malloc(sizeof *ds));
+    ds->flags |= DEFER_SCOPE_HEAP;
     return ds;
 }
 
 defer_scope_t* defer_scope_push(defer_scope_t* ds) {
+#if !USE_THREAD_LOCAL
     pthread_once(&dss_init_once, init_dss);
+#endif
     if (!ds)
         ds = defer_scope_new();
     defer_scope_t* top = get_dss();
     ds->parent = top;
     if (top == NULL) {
-        // Starting from the bottom register thread cleanup on fork
-        pthread_atfork(NULL, NULL, final_cleanup);
+        // Starting from the bottom, the constructor normally did this already
+        pthread_once(&dss_init_once, init_dss);
+#if USE_THREAD_LOCAL
+        if (!defer_exit_armed) {
+            pthread_setspecific(defer_exit_key, (void*)1);
+            defer_exit_armed = true;
+        }
+#endif
     }
     set_dss(ds);
+    STAT_PUSH();
     return ds;
 }
 
+/* Release or reset the popped scope ds, returning its parent */
+static inline defer_scope_t* unlink_scope(defer_scope_t* ds) {
+    defer_scope_t* parent = ds->parent;
+    if (ds->flags & DEFER_SCOPE_HEAP) {
+        free(ds);
+        return parent;
+    }
+    if (ds->flags & DEFER_SCOPE_ROOT)
+        defer_root_live = false;
+    ds->parent = NULL;
+    return parent;
+}
+
+/* Run and unlink every scope from top down to, but not including, until */
+static void unwind(defer_scope_t* top, defer_scope_t* until) {
+    STAT_TIMER_START();
+    while (top != until && top != NULL) {
+        STAT_POP(execute_deferred(top, false));
+        top = unlink_scope(top);
+    }
+    // until was not on this thread's stack, or was popped already
+    assert(top == until);
+    set_dss(top);
+    STAT_TIMER_END();
+    // leaving the outermost scope is a quiescent point, the thread's root
+    // scope never leaves so it does not count
+    if ((!top || top->flags & DEFER_SCOPE_ROOT) && __defer_grace_reader)
+        defer_quiescent();
+}
+
+/* Empty ds without releasing its blocks, nodes or arena, which are left for
+ * the process's end to reclaim, running its external defers first if asked */
+static void drop_scope(defer_scope_t* ds, bool external) {
+    if (ds->flags & DEFER_SCOPE_CONCURRENT) {
+        defer_node_t* n =
+            __atomic_exchange_n(&ds->shared, NULL, __ATOMIC_ACQUIRE);
+        for (; n && external; n = n->next)
+            execute_external(&n->entry, 1);
+    } else {
+        if (external) {
+            for (defer_block_t* b = ds->overflow; b; b = b->next)
+                execute_external(b->entries, b->count);
+            execute_external(ds->routines, ds->count);
+        }
+        ds->overflow = NULL;
+        ds->spare = NULL;
+        ds->count = 0;
+    }
+    ds->arena = NULL;
+}
+
+/* Run the external defers of every scope from top down and unlink them for
+ * DEFER_EXIT_FAST */
+static void exit_unwind(defer_scope_t* top) {
+    while (top) {
+        drop_scope(top, true);
+        top = unlink_scope(top);
+    }
+    set_dss(NULL);
+}
+
 void defer_scope_pop(defer_scope_t* ds) {
     defer_scope_t* top = get_dss();
     assert(top);
+    unwind(top,
+           ds ? (ds == (defer_scope_t*)1 ? NULL : ds->parent) : top->parent);
+}
+
+void defer_stack_swap(defer_stack_t* stack) {
+    defer_scope_t* top = get_dss();
+    set_dss(stack->top);
+    STAT_REBASE(stack->top);
+    stack->top = top;
+}
+
+void defer_scope_unwind(defer_scope_t* ds) {
+    unwind(get_dss(), ds);
+}
+
+jmp_buf* __defer_checkpoint_mark(defer_checkpoint_t* cp) {
+    // on an empty stack the root scope is pushed now, one pushed lazily after
+    // the checkpoint would look newer and be unwound by defer_longjmp
+    cp->scope = current_scope();
+    return &cp->env;
+}
+
+void defer_longjmp(defer_checkpoint_t* cp, int val) {
+    // every frame between here and the checkpoint is still live, so stack
+    // scopes are safe to run before the jump discards them
+    unwind(get_dss(), cp->scope);
+    longjmp(cp->env, val);
+}
+
+void defer_scope_clear(defer_scope_t* ds) {
+    execute_deferred(ds, true);
+}
+
+void defer_scope_delete(defer_scope_t* ds) {
+    execute_deferred(ds, false);
+    if (ds->flags & DEFER_SCOPE_HEAP)
+        free(ds);
+}
+
+defer_scope_t* defer_scope_new_concurrent(void) {
+    defer_scope_t* ds = defer_scope_new();
+    ds->flags |= DEFER_SCOPE_CONCURRENT;
+    return ds;
+}
+
+defer_scope_t* defer_scope_handoff(defer_scope_t* ds) {
+    defer_scope_t* top = get_dss();
+    if (!ds)
+        ds = top;
+    assert(ds == top);
+    // the root scope lives in its thread's storage
+    assert(!(top->flags & DEFER_SCOPE_ROOT));
+    set_dss(top->parent);
+    top->parent = NULL;
+    STAT_UNLINK();
+    return top;
+}
+
+/* Asynchronous teardown.  defer_scope_pop_async moves the entries of the
+ * popped scopes into a chain of heap blocks, newest first, and queues that as
+ * a job for a pool of worker threads.  A job with DEFER_UNORDERED entries is
+ * split, the worker that dequeues it runs the ordered entries in sequence
+ * while the unordered ones are spread in passes over runs of blocks across
+ * the pool, the last pass to finish releases the blocks. */
+
+#ifndef DEFER_ASYNC_SPLIT_BLOCKS
+#define DEFER_ASYNC_SPLIT_BLOCKS 8
+#endif
+
+struct defer_job {
+    struct defer_job* next;
+    struct defer_job* owner;  // for unordered passes, the job split
+    defer_block_t* blocks;
+    size_t nblocks;
+    defer_chunk_t* arena;  // arenas of the popped scopes, released last
+    unsigned pending;
+    bool unordered;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t idle;
+    struct defer_job* head;
+    struct defer_job** tail;
+    size_t outstanding;
+    unsigned workers;
+} defer_async = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                 PTHREAD_COND_INITIALIZER, NULL, &defer_async.head, 0, 0};
+
+/* Move the entries of ds to the end of the chain at *tail, newest first */
+static defer_block_t** detach_entries(defer_scope_t* ds,
+                                      defer_block_t** tail,
+                                      size_t* nblocks) {
+    if (ds->flags & DEFER_SCOPE_CONCURRENT) {
+        defer_node_t* n =
+            __atomic_exchange_n(&ds->shared, NULL, __ATOMIC_ACQUIRE);
+        while (n) {
+            // fill each block from the top down to keep the newest on top
+            defer_block_t* b = block_get();
+            size_t k = 0;
+            for (defer_node_t* c = n; c && k < DEFER_BLOCK_ENTRIES; c = c->next)
+                k++;
+            b->count = k;
+            while (k--) {
+                defer_node_t* next = n->next;
+                b->entries[k] = n->entry;
+                node_put(n);
+                n = next;
+            }
+            *tail = b;
+            tail = &b->next;
+            ++*nblocks;
+        }
+        *tail = NULL;
+        return tail;
+    }
+    *tail = ds->overflow;
+    while (*tail) {
+        tail = &(*tail)->next;
+        ++*nblocks;
+    }
+    if (ds->count) {
+        defer_block_t* b = block_get();
+        memcpy(b->entries, ds->routines, ds->count * sizeof *b->entries);
+        b->count = ds->count;
+        *tail = b;
+        tail = &b->next;
+        *tail = NULL;
+        ++*nblocks;
+    }
+    ds->overflow = NULL;
+    ds->count = 0;
+    ds->flags &= ~DEFER_SCOPE_UNORDERED;
+    release_spare(ds);
+    return tail;
+}
+
+/* Move the arena of ds onto the chain at *arena */
+static void detach_arena(defer_scope_t* ds, defer_chunk_t** arena) {
+    defer_chunk_t* k = ds->arena;
+    if (!k)
+        return;
+    while (k->next)
+        k = k->next;
+    k->next = *arena;
+    *arena = ds->arena;
+    ds->arena = NULL;
+}
+
+static void async_finish(struct defer_job* j) {
+    if (__atomic_sub_fetch(&j->pending, 1, __ATOMIC_ACQ_REL))
+        return;
+    while (j->blocks) {
+        defer_block_t* b = j->blocks;
+        j->blocks = b->next;
+        block_put(b);
+    }
+    chunk_put(j->arena);
+    free(j);
+}
+
+static void async_enqueue(struct defer_job* j) {
+    j->next = NULL;
+    *defer_async.tail = j;
+    defer_async.tail = &j->next;
+    defer_async.outstanding++;
+    pthread_cond_signal(&defer_async.ready);
+}
+
+static void async_run(struct defer_job* j) {
+    if (j->owner) {
+        // an unordered pass over nblocks blocks of its owner's chain
+        defer_block_t* b = j->blocks;
+        for (size_t i = 0; i < j->nblocks; ++i, b = b->next)
+            execute_pass(b->entries, b->count, true);
+        async_finish(j->owner);
+        free(j);
+        return;
+    }
+    if (!j->unordered) {
+        for (defer_block_t* b = j->blocks; b; b = b->next)
+            execute_entries(b->entries, b->count);
+        async_finish(j);
+        return;
+    }
+    pthread_mutex_lock(&defer_async.lock);
+    unsigned passes = j->nblocks / DEFER_ASYNC_SPLIT_BLOCKS;
+    if (passes > defer_async.workers)
+        passes = defer_async.workers;
+    if (passes < 1)
+        passes = 1;
+    size_t per = (j->nblocks + passes - 1) / passes;
+    // rounding per up can leave fewer passes than asked for, count them
+    unsigned enqueued = 0;
+    defer_block_t* b = j->blocks;
+    for (size_t left = j->nblocks; left; left -= per < left ? per : left) {
+        struct defer_job* pass = (struct defer_job*)calloc(1, sizeof *pass);
+        pass->owner = j;
+        pass->blocks = b;
+        pass->nblocks = per < left ? per : left;
+        for (size_t i = 0; i < pass->nblocks; ++i)
+            b = b->next;
+        async_enqueue(pass);
+        enqueued++;
+    }
+    // one reference for the ordered run, one per pass, the passes cannot be
+    // dequeued before the lock is released
+    j->pending = enqueued + 1;
+    pthread_mutex_unlock(&defer_async.lock);
+    for (defer_block_t* o = j->blocks; o; o = o->next)
+        execute_pass(o->entries, o->count, false);
+    async_finish(j);
+}
+
+static void* async_worker(void* unused) {
+    (void)unused;
+    defer_scope_t ws[1];
+    defer_scope_push(defer_scope_init(ws));
+    pthread_mutex_lock(&defer_async.lock);
+    for (;;) {
+        while (!defer_async.head)
+            pthread_cond_wait(&defer_async.ready, &defer_async.lock);
+        struct defer_job* j = defer_async.head;
+        defer_async.head = j->next;
+        if (!defer_async.head)
+            defer_async.tail = &defer_async.head;
+        pthread_mutex_unlock(&defer_async.lock);
+        async_run(j);
+        // anything the callbacks deferred on this thread runs per job
+        defer_scope_clear(ws);
+        pthread_mutex_lock(&defer_async.lock);
+        if (!--defer_async.outstanding)
+            pthread_cond_broadcast(&defer_async.idle);
+    }
+    return NULL;
+}
+
+static void async_grow(unsigned n) {
+    // registers the fork handlers that reset the pool in a child
+    pthread_once(&dss_init_once, init_dss);
+    while (defer_async.workers < n) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, async_worker, NULL))
+            break;
+        pthread_detach(t);
+        defer_async.workers++;
+    }
+}
+
+unsigned defer_async_workers(unsigned n) {
+    pthread_mutex_lock(&defer_async.lock);
+    async_grow(n);
+    n = defer_async.workers;
+    pthread_mutex_unlock(&defer_async.lock);
+    return n;
+}
+
+void defer_async_drain(void) {
+    pthread_mutex_lock(&defer_async.lock);
+    while (defer_async.outstanding)
+        pthread_cond_wait(&defer_async.idle, &defer_async.lock);
+    pthread_mutex_unlock(&defer_async.lock);
+}
+
+void defer_scope_pop_async(defer_scope_t* ds) {
+    defer_scope_t* top = get_dss();
+    assert(top);
+    defer_scope_t* until =
+        ds ? (ds == (defer_scope_t*)1 ? NULL : ds->parent) : top->parent;
+    struct defer_job* j = (struct defer_job*)calloc(1, sizeof *j);
+    defer_block_t** tail = &j->blocks;
+    while (top != until && top != NULL) {
+        j->unordered |= !!(top->flags & DEFER_SCOPE_UNORDERED);
+        tail = detach_entries(top, tail, &j->nblocks);
+        detach_arena(top, &j->arena);
+        STAT_POP(0);
+        top = unlink_scope(top);
+    }
+    set_dss(top);
+    if (!j->blocks) {
+        chunk_put(j->arena);
+        free(j);
+        return;
+    }
+    j->pending = 1;
+    pthread_mutex_lock(&defer_async.lock);
+    if (!defer_async.workers)
+        async_grow(1);
+    async_enqueue(j);
+    pthread_mutex_unlock(&defer_async.lock);
+}
+
+/* Budgeted pops.  The popped scopes' entries are detached into a chain of
+ * blocks like an async job, newest first, and run from the top, each block's
+ * count shrinking as its entries run so the chain always holds exactly what
+ * is left. */
+
+struct defer_detached {
+    defer_block_t* blocks;
+    defer_chunk_t* arena;  // released once every entry has run
+};
+
+static inline uint64_t budget_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+defer_detached_t* defer_detached_run(defer_detached_t* d,
+                                     uint64_t max_ns,
+                                     size_t max_count) {
+    uint64_t start = max_ns ? budget_now() : 0;
+    size_t ran = 0;
+    while (d->blocks) {
+        defer_block_t* b = d->blocks;
+        while (b->count) {
+            if (ran && max_count && ran >= max_count)
+                return d;
+            if (ran && max_ns && !(ran % DEFER_BUDGET_CLOCK_EVERY) &&
+                budget_now() - start >= max_ns)
+                return d;
+            size_t top = --b->count;
+            if (batchable(b->entries + top))
+                b->count -= run_batch(b->entries, top);
+            else
+                b->count -= run_entry(b->entries + top);
+            ran++;
+        }
+        d->blocks = b->next;
+        block_put(b);
+    }
+    chunk_put(d->arena);
+    free(d);
+    return NULL;
+}
+
+defer_detached_t* defer_scope_pop_budget(defer_scope_t* ds,
+                                         uint64_t max_ns,
+                                         size_t max_count) {
+    defer_scope_t* top = get_dss();
+    assert(top);
     defer_scope_t* until =
         ds ? (ds == (defer_scope_t*)1 ? NULL : ds->parent) : top->parent;
+    defer_detached_t* d = (defer_detached_t*)calloc(1, sizeof *d);
+    defer_block_t** tail = &d->blocks;
+    size_t nblocks = 0;
     while (top != until && top != NULL) {
-        execute_deferred(top->routines);
-        defer_scope_t* tmp = top->parent;
-        free(top);
-        top = tmp;
+        tail = detach_entries(top, tail, &nblocks);
+        detach_arena(top, &d->arena);
+        STAT_POP(0);
+        top = unlink_scope(top);
     }
     set_dss(top);
+    return defer_detached_run(d, max_ns, max_count);
+}
+
+/* Grace periods, epoch based.  A callback from defer_after_grace goes in
+ * one of three per-thread limbo lists by the global epoch it was retired in,
+ * the epoch only advances once every registered thread has passed a
+ * quiescent point in it, so once it is two ahead of a list no thread can
+ * hold a reference from before the callback was retired.  Limbo lists of
+ * threads that unregister, and callbacks from unregistered threads, are
+ * orphaned to a global list run by whichever thread advances past them. */
+
+struct defer_reader {
+    struct defer_reader* next;
+    struct defer_reader** prev;
+    uint64_t epoch;  // last epoch the thread was quiescent in
+};
+
+struct defer_limbo {
+    defer_block_t* blocks;
+    uint64_t epoch;
+};
+
+struct defer_orphan {
+    struct defer_orphan* next;
+    defer_block_t* blocks;
+    uint64_t epoch;
+};
+
+static uint64_t defer_epoch = 0;
+
+static struct {
+    pthread_mutex_t lock;
+    struct defer_reader* readers;
+    struct defer_orphan* orphans;
+} defer_grace = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL};
+
+static DEFER_TLS struct defer_reader defer_reader_self;
+static DEFER_TLS struct defer_limbo defer_limbo[3];
+static DEFER_TLS size_t defer_limbo_pending;
+
+static void run_blocks(defer_block_t* b) {
+    while (b) {
+        defer_block_t* next = b->next;
+        execute_entries(b->entries, b->count);
+        block_put(b);
+        b = next;
+    }
+}
+
+/* Orphan the blocks of a callback batch retired in epoch, under the lock */
+static void orphan_locked(defer_block_t* blocks, uint64_t epoch) {
+    struct defer_orphan* o = (struct defer_orphan*)malloc(sizeof *o);
+    o->blocks = blocks;
+    o->epoch = epoch;
+    o->next = defer_grace.orphans;
+    // read unlocked by defer_quiescent
+    __atomic_store_n(&defer_grace.orphans, o, __ATOMIC_RELAXED);
+}
+
+/* Advance the epoch past now if every registered thread has been quiescent in
+ * it, then run the orphans that are old enough */
+static void try_advance(uint64_t now) {
+    defer_block_t* ready = NULL;
+    pthread_mutex_lock(&defer_grace.lock);
+    bool all = true;
+    for (struct defer_reader* r = defer_grace.readers; r && all; r = r->next)
+        all = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST) == now;
+    if (all &&
+        __atomic_compare_exchange_n(&defer_epoch, &now, now + 1, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        now++;
+    for (struct defer_orphan** o = &defer_grace.orphans; *o;) {
+        struct defer_orphan* tmp = *o;
+        if (tmp->epoch + 2 > now) {
+            o = &tmp->next;
+            continue;
+        }
+        __atomic_store_n(o, tmp->next, __ATOMIC_RELAXED);
+        defer_block_t* last = tmp->blocks;
+        while (last->next)
+            last = last->next;
+        last->next = ready;
+        ready = tmp->blocks;
+        free(tmp);
+    }
+    pthread_mutex_unlock(&defer_grace.lock);
+    run_blocks(ready);
+}
+
+void defer_thread_register(void) {
+    if (__defer_grace_reader)
+        return;
+    pthread_once(&dss_init_once, init_dss);
+    pthread_mutex_lock(&defer_grace.lock);
+    defer_reader_self.epoch = __atomic_load_n(&defer_epoch, __ATOMIC_SEQ_CST);
+    defer_reader_self.next = defer_grace.readers;
+    defer_reader_self.prev = &defer_grace.readers;
+    if (defer_grace.readers)
+        defer_grace.readers->prev = &defer_reader_self.next;
+    defer_grace.readers = &defer_reader_self;
+    pthread_mutex_unlock(&defer_grace.lock);
+    pthread_setspecific(defer_grace_key, (void*)1);
+    __defer_grace_reader = true;
+}
+
+void defer_thread_unregister(void) {
+    if (!__defer_grace_reader)
+        return;
+    __defer_grace_reader = false;
+    pthread_setspecific(defer_grace_key, NULL);
+    pthread_mutex_lock(&defer_grace.lock);
+    *defer_reader_self.prev = defer_reader_self.next;
+    if (defer_reader_self.next)
+        defer_reader_self.next->prev = defer_reader_self.prev;
+    for (int i = 0; i < 3; ++i) {
+        if (defer_limbo[i].blocks)
+            orphan_locked(defer_limbo[i].blocks, defer_limbo[i].epoch);
+        defer_limbo[i].blocks = NULL;
+    }
+    defer_limbo_pending = 0;
+    pthread_mutex_unlock(&defer_grace.lock);
+    // this thread may have been the one holding the epoch back
+    try_advance(__atomic_load_n(&defer_epoch, __ATOMIC_SEQ_CST));
+}
+
+static void grace_exit(void* unused) {
+    (void)unused;
+    defer_thread_unregister();
+}
+
+void defer_quiescent(void) {
+    if (!__defer_grace_reader)
+        return;
+    uint64_t now = __atomic_load_n(&defer_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&defer_reader_self.epoch, now, __ATOMIC_SEQ_CST);
+    if (!defer_limbo_pending &&
+        !__atomic_load_n(&defer_grace.orphans, __ATOMIC_RELAXED))
+        return;
+    try_advance(now);
+    now = __atomic_load_n(&defer_epoch, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < 3; ++i) {
+        struct defer_limbo* l = &defer_limbo[i];
+        if (l->blocks && l->epoch + 2 <= now) {
+            defer_block_t* b = l->blocks;
+            l->blocks = NULL;
+            for (defer_block_t* c = b; c; c = c->next)
+                defer_limbo_pending -= c->count;
+            run_blocks(b);
+        }
+    }
+}
+
+void defer_after_grace(deferable_free_like fn, void* p) {
+    assert(fn);
+    defer_t e = {.kind = DEFER_KIND_ARG, .fn = fn, .data = p};
+    TRACE_TAKE(&e);
+    if (!__defer_grace_reader) {
+        defer_block_t* b = block_get();
+        b->entries[b->count++] = e;
+        b->next = NULL;
+        pthread_mutex_lock(&defer_grace.lock);
+        if (!defer_grace.readers) {
+            // nobody to wait for
+            pthread_mutex_unlock(&defer_grace.lock);
+            run_blocks(b);
+            return;
+        }
+        orphan_locked(b, __atomic_load_n(&defer_epoch, __ATOMIC_SEQ_CST));
+        pthread_mutex_unlock(&defer_grace.lock);
+        return;
+    }
+    uint64_t now = __atomic_load_n(&defer_epoch, __ATOMIC_SEQ_CST);
+    struct defer_limbo* l = &defer_limbo[now % 3];
+    if (l->blocks && l->epoch != now) {
+        // three or more epochs old, long safe
+        defer_block_t* b = l->blocks;
+        l->blocks = NULL;
+        for (defer_block_t* c = b; c; c = c->next)
+            defer_limbo_pending -= c->count;
+        run_blocks(b);
+    }
+    l->epoch = now;
+    defer_block_t* b = l->blocks;
+    if (!b || b->count == DEFER_BLOCK_ENTRIES) {
+        b = block_get();
+        b->next = l->blocks;
+        l->blocks = b;
+    }
+    b->entries[b->count++] = e;
+    defer_limbo_pending++;
+}
+
+/* Fork handling.  Every lock a child could need is held across the fork so
+ * the child gets them consistent, the parent's workers do not exist in the
+ * child, nor do its jobs, and the forking thread's scopes are run, dropped or
+ * kept by the fork policy. */
+
+static enum defer_fork_policy defer_fork_policy = DEFER_FORK_RUN;
+
+void defer_set_fork_policy(enum defer_fork_policy policy) {
+    __atomic_store_n(&defer_fork_policy, policy, __ATOMIC_RELAXED);
+}
+
+/* Shared by the fork child and final_cleanup */
+static enum defer_exit_policy defer_exit_policy = DEFER_EXIT_RUN;
+
+void defer_set_exit_policy(enum defer_exit_policy policy) {
+    __atomic_store_n(&defer_exit_policy, policy, __ATOMIC_RELAXED);
+}
+
+static inline bool exit_fast(void) {
+    return __atomic_load_n(&defer_exit_policy, __ATOMIC_RELAXED) ==
+           DEFER_EXIT_FAST;
+}
+
+static void fork_prepare(void) {
+    pthread_mutex_lock(&defer_async.lock);
+    pthread_mutex_lock(&defer_depot.lock);
+    pthread_mutex_lock(&defer_grace.lock);
+#ifdef DEFER_STATS
+    pthread_mutex_lock(&defer_stats_lock);
+#endif
+#ifdef DEFER_TRACE
+    pthread_mutex_lock(&chrome_lock);
+#endif
+}
+
+static void fork_parent(void) {
+#ifdef DEFER_TRACE
+    pthread_mutex_unlock(&chrome_lock);
+#endif
+#ifdef DEFER_STATS
+    pthread_mutex_unlock(&defer_stats_lock);
+#endif
+    pthread_mutex_unlock(&defer_grace.lock);
+    pthread_mutex_unlock(&defer_depot.lock);
+    pthread_mutex_unlock(&defer_async.lock);
+}
+
+static void fork_child(void) {
+    fork_parent();
+    pthread_mutex_init(&defer_async.lock, NULL);
+    pthread_cond_init(&defer_async.ready, NULL);
+    pthread_cond_init(&defer_async.idle, NULL);
+    defer_async.head = NULL;
+    defer_async.tail = &defer_async.head;
+    defer_async.outstanding = 0;
+    defer_async.workers = 0;
+    // only this thread is left to hold grace periods back
+    defer_grace.readers = NULL;
+    if (__defer_grace_reader) {
+        defer_reader_self.next = NULL;
+        defer_reader_self.prev = &defer_grace.readers;
+        defer_grace.readers = &defer_reader_self;
+    }
+
+    // the scopes stay linked either way, the child's frames still own them
+    // and pop them as usual, finding them empty
+    switch (__atomic_load_n(&defer_fork_policy, __ATOMIC_RELAXED)) {
+        case DEFER_FORK_RUN:
+            // the root scope's defers belong to the thread, they run at exit
+            for (defer_scope_t* ds = get_dss();
+                 ds && !(ds->flags & DEFER_SCOPE_ROOT); ds = ds->parent) {
+                if (exit_fast())
+                    drop_scope(ds, true);
+                else
+                    execute_deferred(ds, false);
+            }
+            break;
+        case DEFER_FORK_DISCARD:
+            // left for exec or _exit to reclaim
+            for (defer_scope_t* ds = get_dss(); ds; ds = ds->parent)
+                drop_scope(ds, false);
+            break;
+        case DEFER_FORK_KEEP:
+            break;
+    }
 }
 
 defer_scope_t* defer_scope_begin(void) {
@@ -119,43 +1610,416 @@ void defer_scope_end(void) {
 #endif
 INIT(defer_scope_auto_init);
 
+static defer_scope_t* push_root(void) {
+    // already in use on a stack swapped out by defer_stack_swap
+    if (defer_root_live)
+        return defer_scope_push(NULL);
+    defer_root_live = true;
+    defer_scope_init(&defer_root)->flags = DEFER_SCOPE_ROOT;
+    return defer_scope_push(&defer_root);
+}
+
+/* Scope for the defer_* functions without a scope argument */
+static inline defer_scope_t* current_scope(void) {
+    defer_scope_t* ds = get_dss();
+    if (__builtin_expect(!ds, 0))
+        ds = push_root();
+    return ds;
+}
+
+defer_scope_t* defer_scope_current(void) {
+    return current_scope();
+}
+
 void defer_scope_auto_init(void) {
-    defer_scope_begin();
+    push_root();
 }
 
-static void execute_all_deferred(void* dscope /* defer_scope_t * */) {
-    defer_scope_pop((defer_scope_t*)dscope);
+/* Runs everything left on an exiting thread's stack, the root scope
+ * included, before its cache is released */
+static void thread_exit(void* top /* defer_scope_t * */) {
+#if USE_THREAD_LOCAL
+    (void)top;
+    defer_exit_armed = false;
+#else
+    // the key was cleared before calling us
+    set_dss((defer_scope_t*)top);
+#endif
+    if (get_dss())
+        unwind(get_dss(), NULL);
+    STAT_THREAD_EXIT();
 }
 
 static void final_cleanup(void) {
-    defer_scope_pop((defer_scope_t*)1);
+    if (exit_fast()) {
+        exit_unwind(get_dss());
+        // queued jobs may hold external defers, the cache is only memory
+        defer_async_drain();
+        return;
+    }
+    if (get_dss())
+        unwind(get_dss(), NULL);
+    defer_async_drain();
+    release_cache(&defer_node_cache);
+}
+
+size_t defer_cache_trim(size_t keep) {
+    return trim_cache(&defer_node_cache, keep);
+}
+
+void defer_cache_limit(size_t max) {
+    defer_node_cache.limit = max;
+    defer_cache_trim(max);
+}
+
+/* Reserve n contiguous slots at the top of s */
+static inline defer_t* defer_append_n(defer_scope_t* s, unsigned n) {
+    STAT_DEFER();
+    if (s->count + n <= DEFER_SCOPE_INLINE) {
+        defer_t* e = &s->routines[s->count];
+        s->count += n;
+        return e;
+    }
+    // pad out the inline slots so nothing newer lands below the overflow
+    while (s->count < DEFER_SCOPE_INLINE)
+        s->routines[s->count++] = (defer_t){.kind = DEFER_KIND_NONE};
+    defer_block_t* b = s->overflow;
+    if (!b || b->count + n > DEFER_BLOCK_ENTRIES) {
+        if (s->spare) {
+            b = s->spare;
+            s->spare = b->next;
+            b->count = 0;
+        } else {
+            b = block_get();
+        }
+        b->next = s->overflow;
+        s->overflow = b;
+    }
+    defer_t* e = &b->entries[b->count];
+    b->count += n;
+    return e;
+}
+
+static defer_t* concurrent_add(defer_scope_t* s, defer_t e) {
+    STAT_DEFER();
+    defer_node_t* n = node_get();
+    n->entry = e;
+    n->next = __atomic_load_n(&s->shared, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&s->shared, &n->next, n, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return &n->entry;
+}
+
+void* defer_scope_alloc(defer_scope_t* ds, size_t size) {
+    assert(!(ds->flags & DEFER_SCOPE_CONCURRENT));
+    // rounding up to units, then adding the chunk header, must not wrap
+    if (size > SIZE_MAX - sizeof(defer_chunk_t) - sizeof(defer_align_t))
+        return NULL;
+    size_t units = (size + sizeof(defer_align_t) - 1) / sizeof(defer_align_t);
+    if (!units)
+        units = 1;
+    defer_chunk_t* k = ds->arena;
+    if (!k || k->size - k->used < units) {
+        k = chunk_get(units);
+        if (!k)
+            return NULL;
+        if (ds->arena && units > ARENA_UNITS) {
+            // keep bumping from the current chunk, put the big one behind it
+            k->next = ds->arena->next;
+            ds->arena->next = k;
+        } else {
+            k->next = ds->arena;
+            ds->arena = k;
+        }
+    }
+    void* p = k->data + k->used;
+    k->used += units;
+    return p;
+}
+
+void* defer_alloc(size_t size) {
+    return defer_scope_alloc(current_scope(), size);
+}
+
+/* Add the single-slot entry e to s, returning where it was stored */
+static inline defer_t* defer_add(defer_scope_t* s, defer_t e) {
+    TRACE_TAKE(&e);
+    if (s->flags & DEFER_SCOPE_CONCURRENT)
+        return concurrent_add(s, e);
+    defer_t* slot = defer_append_n(s, 1);
+    *slot = e;
+    return slot;
+}
+
+int defer_lock(pthread_mutex_t* m) {
+    int err = pthread_mutex_lock(m);
+    if (err)
+        TRACE_DROP();
+    else
+        defer_add(current_scope(),
+                  (defer_t){.kind = DEFER_KIND_MUTEX, .data = m});
+    return err;
+}
+
+void defer_unlock(pthread_mutex_t* m) {
+    defer_add(current_scope(), (defer_t){.kind = DEFER_KIND_MUTEX, .data = m});
+}
+
+int defer_rdlock(pthread_rwlock_t* l) {
+    int err = pthread_rwlock_rdlock(l);
+    if (err)
+        TRACE_DROP();
+    else
+        defer_add(current_scope(),
+                  (defer_t){.kind = DEFER_KIND_RWLOCK, .data = l});
+    return err;
+}
+
+int defer_wrlock(pthread_rwlock_t* l) {
+    int err = pthread_rwlock_wrlock(l);
+    if (err)
+        TRACE_DROP();
+    else
+        defer_add(current_scope(),
+                  (defer_t){.kind = DEFER_KIND_RWLOCK, .data = l});
+    return err;
+}
+
+void defer_close(int fd) {
+    defer_add(current_scope(),
+              (defer_t){.kind = DEFER_KIND_CLOSE, .data = (void*)(intptr_t)fd});
+}
+
+void defer_munmap(void* addr, size_t len) {
+    defer_add(current_scope(),
+              (defer_t){.kind = DEFER_KIND_MUNMAP, .len = len, .data = addr});
 }
 
-static void defer_append(defer_scope_t* s, defer_t* d) {
-    d->next = s->routines;
-    s->routines = d;
+int defer_unlink(const char* path) {
+    defer_scope_t* ds = current_scope();
+    size_t n = strlen(path) + 1;
+    char* copy = (char*)defer_scope_alloc(ds, n);
+    if (!copy) {
+        TRACE_DROP();
+        return -1;
+    }
+    memcpy(copy, path, n);
+    defer_add(ds, (defer_t){.kind = DEFER_KIND_UNLINK, .data = copy});
+    return 0;
 }
 
 void defer_specific(defer_scope_t* ds, deferable_free_like fn, void* p) {
     assert(fn);
-    defer_t* nd = (defer_t*)malloc(sizeof *nd);
-    *nd = (defer_t){.arg = 1, .fn = fn, .data = p};
-    defer_append(ds, nd);
+    defer_add(ds, (defer_t){.kind = DEFER_KIND_ARG, .fn = fn, .data = p});
 }
 
 void defer_specific_noarg(defer_scope_t* ds, deferable_noarg fn) {
     assert(fn);
-    defer_t* nd = (defer_t*)malloc(sizeof *nd);
-    nd->arg = 0;
-    nd->noarg = fn;
-    nd->data = NULL;
-    defer_append(ds, nd);
+    defer_add(ds, (defer_t){.kind = DEFER_KIND_NOARG, .noarg = fn});
+}
+
+defer_handle_t defer_specific_cancelable(defer_scope_t* ds,
+                                         deferable_free_like fn,
+                                         void* p) {
+    assert(fn);
+    return defer_add(ds,
+                     (defer_t){.kind = DEFER_KIND_ARG, .fn = fn, .data = p});
+}
+
+void defer_specific_flags(defer_scope_t* ds,
+                          deferable_free_like fn,
+                          void* p,
+                          unsigned flags) {
+    assert(fn);
+    if (flags & DEFER_UNORDERED)
+        ds->flags |= DEFER_SCOPE_UNORDERED;
+    defer_add(ds, (defer_t){.kind = DEFER_KIND_ARG | flags,
+                            .fn = fn,
+                            .data = p});
+}
+
+void defer_specific_many(defer_scope_t* ds,
+                         deferable_free_like fn,
+                         void* const* args,
+                         size_t n) {
+    assert(fn);
+    if (!n) {
+        TRACE_DROP();
+        return;
+    }
+    struct defer_many* m =
+        (struct defer_many*)malloc(sizeof *m + n * sizeof *m->args);
+    m->count = n;
+    memcpy(m->args, args, n * sizeof *m->args);
+    defer_add(ds, (defer_t){.kind = DEFER_KIND_MANY, .fn = fn, .data = m});
+}
+
+void* defer_specific_payload(defer_scope_t* ds,
+                             deferable_free_like fn,
+                             const void* payload,
+                             size_t size) {
+    assert(fn);
+    void* copy;
+    if (size > DEFER_PAYLOAD_MAX || ds->flags & DEFER_SCOPE_CONCURRENT) {
+        copy = malloc(size);
+        defer_add(ds, (defer_t){.kind = DEFER_KIND_PAYLOAD_HEAP,
+                                .fn = fn,
+                                .data = copy});
+    } else {
+        unsigned slots = (size + sizeof(defer_t) - 1) / sizeof(defer_t);
+        defer_t* e = defer_append_n(ds, slots + 1);
+        copy = e;
+        e[slots] =
+            (defer_t){.kind = DEFER_KIND_PAYLOAD, .fn = fn, .size = slots};
+        TRACE_TAKE(&e[slots]);
+    }
+    if (payload)
+        memcpy(copy, payload, size);
+    return copy;
 }
 
 void defer(deferable_free_like fn, void* p) {
-    defer_specific(get_dss(), fn, p);
+    defer_specific(current_scope(), fn, p);
 }
 
 void defer_noarg(deferable_noarg fn) {
-    defer_specific_noarg(get_dss(), fn);
+    defer_specific_noarg(current_scope(), fn);
+}
+
+defer_handle_t defer_cancelable(deferable_free_like fn, void* p) {
+    return defer_specific_cancelable(current_scope(), fn, p);
+}
+
+void defer_flags(deferable_free_like fn, void* p, unsigned flags) {
+    defer_specific_flags(current_scope(), fn, p, flags);
+}
+
+void defer_many(deferable_free_like fn, void* const* args, size_t n) {
+    defer_specific_many(current_scope(), fn, args, n);
+}
+
+void* defer_payload(deferable_free_like fn, const void* payload, size_t size) {
+    return defer_specific_payload(current_scope(), fn, payload, size);
+}
+
+/* TRACING */
+
+#ifdef DEFER_TRACE
+
+void defer_set_hooks(const defer_hooks_t* hooks) {
+    __atomic_store_n(&defer_hooks, hooks, __ATOMIC_RELEASE);
+}
+
+/* Chrome trace writer: one complete ("X") event per callback, start times of
+ * callbacks still running on this thread kept on a small stack so callbacks
+ * that pop scopes of their own nest properly */
+#define CHROME_DEPTH 64
+
+static FILE* chrome_file = NULL;
+static bool chrome_first;
+static unsigned chrome_next_tid = 0;
+static DEFER_TLS unsigned chrome_tid;
+static DEFER_TLS uint64_t chrome_start[CHROME_DEPTH];
+static DEFER_TLS unsigned chrome_depth;
+
+static uint64_t chrome_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void chrome_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void chrome_enter(const defer_site_t* site, void* ctx) {
+    (void)site;
+    (void)ctx;
+    if (chrome_depth < CHROME_DEPTH)
+        chrome_start[chrome_depth] = chrome_now();
+    chrome_depth++;
+}
+
+static void chrome_exit(const defer_site_t* site, void* ctx) {
+    (void)ctx;
+    uint64_t end = chrome_now();
+    if (!chrome_depth || --chrome_depth >= CHROME_DEPTH)
+        return;
+    uint64_t start = chrome_start[chrome_depth];
+    if (!chrome_tid)
+        chrome_tid = __atomic_add_fetch(&chrome_next_tid, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&chrome_lock);
+    FILE* f = chrome_file;
+    if (f) {
+        fputs(chrome_first ? "\n" : ",\n", f);
+        chrome_first = false;
+        fputs("{\"name\":", f);
+        chrome_string(f, site->callback);
+        fprintf(f,
+                ",\"cat\":\"defer\",\"ph\":\"X\",\"ts\":%.3f,"
+                "\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"file\":",
+                start / 1e3, (end - start) / 1e3, chrome_tid);
+        chrome_string(f, site->file);
+        fprintf(f, ",\"line\":%d,\"func\":", site->line);
+        chrome_string(f, site->func);
+        fputs("}}", f);
+    }
+    pthread_mutex_unlock(&chrome_lock);
 }
+
+static const defer_hooks_t chrome_hooks = {.enter = chrome_enter,
+                                           .exit = chrome_exit};
+
+bool defer_trace_chrome_open(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f)
+        return false;
+    defer_trace_chrome_close();
+    pthread_mutex_lock(&chrome_lock);
+    fputc('[', f);
+    chrome_file = f;
+    chrome_first = true;
+    pthread_mutex_unlock(&chrome_lock);
+    defer_set_hooks(&chrome_hooks);
+    return true;
+}
+
+void defer_trace_chrome_close(void) {
+    if (__atomic_load_n(&defer_hooks, __ATOMIC_ACQUIRE) == &chrome_hooks)
+        defer_set_hooks(NULL);
+    pthread_mutex_lock(&chrome_lock);
+    FILE* f = chrome_file;
+    chrome_file = NULL;
+    pthread_mutex_unlock(&chrome_lock);
+    if (f) {
+        fputs("\n]\n", f);
+        fclose(f);
+    }
+}
+
+#else  // DEFER_TRACE
+
+void defer_set_hooks(const defer_hooks_t* hooks) {
+    (void)hooks;
+}
+
+bool defer_trace_chrome_open(const char* path) {
+    (void)path;
+    return false;
+}
+
+void defer_trace_chrome_close(void) {}
+
+#endif  // DEFER_TRACE
@@ -2,17 +2,151 @@
 #define __DEFER_H 1
 #include "defer_macros.h"
 
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-typedef struct defer defer_t;
-typedef struct defer_scope {
-    struct defer_scope* parent;
-    defer_t* routines;
-} defer_scope_t;
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef void (*deferable_free_like)(void*);
 typedef void (*deferable_noarg)(void);
 
+#if defined(__cplusplus) || __STDC_VERSION__ < 201112L
+#define __DEFER_TLS __thread
+#else
+#define __DEFER_TLS _Thread_local
+#endif
+
+/**
+ * Where a defer was registered, recorded by the registration macros when
+ * built with DEFER_TRACE
+ */
+typedef struct defer_site {
+    const char* file;
+    int line;
+    const char* func;      // function that registered the defer
+    const char* callback;  // the deferred function, as written
+} defer_site_t;
+
+/**
+ * Number of defers stored directly in each scope, entries beyond this are
+ * chained in heap blocks cached per-thread.  Part of the layout, see
+ * __DEFER_LAYOUT, so it must be a plain integer and the same for libdefer and
+ * every file using it.
+ */
+#ifndef DEFER_SCOPE_INLINE
+#define DEFER_SCOPE_INLINE 4
+#endif
+
+/**
+ * Largest payload defer_payload copies into the scope itself, larger ones get
+ * a heap copy.  Must fit in an overflow block, and like DEFER_SCOPE_INLINE be
+ * a plain integer that matches the library's.
+ */
+#ifndef DEFER_PAYLOAD_MAX
+#define DEFER_PAYLOAD_MAX 64
+#endif
+
+enum defer_kind {
+    DEFER_KIND_NONE = 0,
+    DEFER_KIND_ARG,
+    DEFER_KIND_NOARG,
+    DEFER_KIND_MANY,
+    DEFER_KIND_PAYLOAD,
+    DEFER_KIND_PAYLOAD_HEAP,
+    DEFER_KIND_MUTEX,   // data is a pthread_mutex_t* to unlock
+    DEFER_KIND_RWLOCK,  // data is a pthread_rwlock_t* to unlock
+    DEFER_KIND_CLOSE,   // data is the file descriptor to close
+    DEFER_KIND_MUNMAP,  // data is the mapping, len its length
+    DEFER_KIND_UNLINK,  // data is the path to unlink, in the scope's arena
+};
+
+/**
+ * Flags for defer_flags, stored above DEFER_KIND_MASK in defer_t.kind
+ *
+ * DEFER_UNORDERED marks a defer that has no ordering requirement relative to
+ * any other defer in its scope, when the scope is popped with
+ * defer_scope_pop_async such defers may run in parallel.
+ *
+ * DEFER_MEMORY marks a defer that only releases memory of this process, with
+ * no effect outside it, which DEFER_EXIT_FAST skips.  Defers of free and
+ * defer_munmap count as memory-only without it.
+ */
+#define DEFER_KIND_MASK 0xffffu
+enum defer_flags {
+    DEFER_UNORDERED = 1u << 16,
+    DEFER_MEMORY = 1u << 17,
+};
+
+/* A payload entry is preceded in its scope by size slots holding the copy */
+typedef struct defer {
+    union {
+        deferable_free_like fn;
+        deferable_noarg noarg;
+        size_t len;
+    };
+    void* data;
+    unsigned kind;
+    unsigned size;
+#ifdef DEFER_TRACE
+    const defer_site_t* site;
+#endif
+} defer_t;
+
+/* DEFER_TRACE grows defer_t, DEFER_SCOPE_INLINE every scope and
+ * DEFER_PAYLOAD_MAX the entries a payload takes, so libdefer and all code
+ * using it must agree on them.  Each file including this header references
+ * the symbol naming its layout, e.g. __defer_layout_plain_4_64, which only a
+ * library built the same way defines, turning a mismatch into a link error
+ * rather than undersized stack scopes. */
+#ifdef DEFER_TRACE
+#define __DEFER_LAYOUT_KIND trace
+#else
+#define __DEFER_LAYOUT_KIND plain
+#endif
+#define __DEFER_LAYOUT_NAME(K, I, P) __DEFER_LAYOUT_NAME_(K, I, P)
+#define __DEFER_LAYOUT_NAME_(K, I, P) __defer_layout_##K##_##I##_##P
+#define __DEFER_LAYOUT                                          \
+    __DEFER_LAYOUT_NAME(__DEFER_LAYOUT_KIND, DEFER_SCOPE_INLINE, \
+                        DEFER_PAYLOAD_MAX)
+extern const char __DEFER_LAYOUT;
+static const char* const __defer_layout_check __attribute__((used)) =
+    &__DEFER_LAYOUT;
+
+/**
+ * Scope flags, DEFER_SCOPE_HEAP marks scopes whose storage belongs to libdefer
+ * and is freed when they are popped, all other scopes live in caller-provided
+ * storage (stack, arena, embedded in another structure...)
+ */
+enum defer_scope_flags {
+    DEFER_SCOPE_HEAP = 1u << 0,
+    DEFER_SCOPE_CONCURRENT = 1u << 1,
+    DEFER_SCOPE_UNORDERED = 1u << 2,  // holds DEFER_UNORDERED defers
+    DEFER_SCOPE_ROOT = 1u << 3,       // a thread's automatic root scope
+};
+
+/**
+ * Handle to a single registered defer, see defer_cancelable
+ */
+typedef defer_t* defer_handle_t;
+
+typedef struct defer_scope {
+    struct defer_scope* parent;
+    union {
+        struct defer_block* overflow;
+        struct defer_node* shared;  // DEFER_SCOPE_CONCURRENT scopes
+    };
+    struct defer_block* spare;
+    struct defer_chunk* arena;  // defer_scope_alloc memory, newest first
+    unsigned count;
+    unsigned flags;
+    defer_t routines[DEFER_SCOPE_INLINE];
+} defer_scope_t;
+
 /**
  * @brief Begin a new defer scope for this thread here
  *
@@ -26,6 +160,39 @@ defer_scope_t* defer_scope_begin(void);
  */
 void defer_scope_end(void);
 
+/**
+ * @brief Initialize caller-provided storage as an empty, un-registered scope
+ *
+ * Scopes initialized this way are never freed by libdefer, popping one only
+ * runs its defers and leaves it empty and ready to be pushed again.
+ *
+ * @param ds storage for the scope, may be on the stack
+ *
+ * @return ds
+ */
+static inline defer_scope_t* defer_scope_init(defer_scope_t* ds) {
+    ds->parent = NULL;
+    ds->overflow = NULL;
+    ds->spare = NULL;
+    ds->arena = NULL;
+    ds->count = 0;
+    ds->flags = 0;
+    return ds;
+}
+
+/**
+ * @brief Initialize caller-provided storage as an empty concurrent scope, see
+ * defer_scope_new_concurrent
+ *
+ * @param ds storage for the scope
+ *
+ * @return ds
+ */
+static inline defer_scope_t* defer_scope_init_concurrent(defer_scope_t* ds) {
+    defer_scope_init(ds)->flags = DEFER_SCOPE_CONCURRENT;
+    return ds;
+}
+
 /**
  * @brief Create a wrapper function that creates a defer scope around the
  * function being defined, only use for void return functions.
@@ -38,8 +205,8 @@ void defer_scope_end(void);
  * defer-scoped functions is that however you leave the function so wrapped,
  * the defers will run.  No calls or return macros are required inside the
  * function when it is defined this way. The only exception to this is using
- * setjmp/longjmp, that must be handled by use of pop to clean up all scopes
- * back to a known point around the setjmp point.
+ * setjmp/longjmp, use defer_checkpoint and defer_longjmp in place of them to
+ * clean up all scopes back to the setjmp point.
  *
  * Use like this:
  * DEFER_SCOPED_VOID(test_fn, (int, a, char *, b)) {
@@ -82,8 +249,9 @@ void defer_scope_end(void);
 
 /**
  * @brief DEFER_SCOPED using stack memory for the defer_scope structure, this
- * saves some allocation overhead, but is only safe when longjmp and similar
- * are impossible in the contained function
+ * avoids allocation entirely for functions registering up to
+ * DEFER_SCOPE_INLINE defers, but is only safe when longjmp and similar are
+ * impossible in the contained function
  *
  * @param RET return type of the function to be defined
  * @param NAME function name to define
@@ -96,7 +264,7 @@ void defer_scope_end(void);
     static inline RET __defer_inner##NAME __DEFER_ARGS ARG_LIST; \
     RET NAME __DEFER_ARGS ARG_LIST {                             \
         defer_scope_t ds[1];                                     \
-        defer_scope_push(ds);                                    \
+        defer_scope_push(defer_scope_init(ds));                  \
         RET r = __defer_inner##NAME __DEFER_CALL ARG_LIST;       \
         defer_scope_pop(ds);                                     \
         return r;                                                \
@@ -107,7 +275,7 @@ void defer_scope_end(void);
     static inline void __defer_inner##NAME __DEFER_ARGS ARG_LIST; \
     void NAME __DEFER_ARGS ARG_LIST {                             \
         defer_scope_t ds[1];                                      \
-        defer_scope_push(ds);                                     \
+        defer_scope_push(defer_scope_init(ds));                   \
         __defer_inner##NAME __DEFER_CALL ARG_LIST;                \
         defer_scope_pop(ds);                                      \
     }                                                             \
@@ -143,13 +311,90 @@ void defer_scope_end(void);
 /**
  * @brief Push a new scope onto the stack
  *
- * @param ds An initialized scope from defer_scope_new or NULL to create a new
- * scope
+ * @param ds An initialized scope from defer_scope_new or defer_scope_init, or
+ * NULL to create a new scope
  *
  * @return The scope added to the top of the stack
  */
 defer_scope_t* defer_scope_push(defer_scope_t* ds);
 
+/**
+ * @brief Pop scopes like defer_scope_pop, but run their defers on a pool of
+ * background threads
+ *
+ * The calling thread only pays for moving the popped scopes' defers into a
+ * job and queueing it, the defers then run on a worker thread in the usual
+ * order.  Defers registered with DEFER_UNORDERED may additionally be split
+ * across the pool to run in parallel.  Jobs are not ordered relative to each
+ * other, only use this for defers that are safe to run on another thread
+ * after this returns.  A single worker is started on first use.
+ *
+ * @param ds The scope to pop to or NULL for innermost scope
+ */
+void defer_scope_pop_async(defer_scope_t* ds);
+
+/**
+ * @brief Start background cleanup workers until there are at least n
+ *
+ * @param n number of workers wanted
+ *
+ * @return the number of workers running
+ */
+unsigned defer_async_workers(unsigned n);
+
+/**
+ * @brief Wait for every job queued by defer_scope_pop_async to finish, this
+ * is done automatically at exit
+ */
+void defer_async_drain(void);
+
+/**
+ * Number of defers defer_scope_pop_budget runs between reads of the clock
+ */
+#ifndef DEFER_BUDGET_CLOCK_EVERY
+#define DEFER_BUDGET_CLOCK_EVERY 16
+#endif
+
+/**
+ * Handle on the defers of scopes popped with defer_scope_pop_budget that have
+ * not run yet
+ */
+typedef struct defer_detached defer_detached_t;
+
+/**
+ * @brief Pop scopes like defer_scope_pop, but only run as many of their
+ * defers as fit in a budget, leaving the rest to defer_detached_run
+ *
+ * The scopes are unlinked from the thread's stack right away, their defers
+ * then run on this thread in the usual order, a slice at a time.  Meant for
+ * event loops that cannot stall on a large teardown but whose cleanups touch
+ * state owned by the loop, so defer_scope_pop_async will not do.  At least
+ * one defer runs per call, the clock is only read every few defers so a slow
+ * one can overrun the budget.
+ *
+ * @param ds The scope to pop to or NULL for innermost scope
+ * @param max_ns Stop once this many nanoseconds have passed, 0 for no limit
+ * @param max_count Stop after running this many defers, 0 for no limit
+ *
+ * @return NULL if every defer ran, otherwise a handle to pass to
+ * defer_detached_run until it returns NULL
+ */
+defer_detached_t* defer_scope_pop_budget(defer_scope_t* ds,
+                                         uint64_t max_ns,
+                                         size_t max_count);
+
+/**
+ * @brief Run the next slice of the defers in d, see defer_scope_pop_budget
+ *
+ * May be called on any thread, but only on one at a time.  Both limits 0 runs
+ * everything that is left.
+ *
+ * @return NULL once every defer has run and d is released, otherwise d
+ */
+defer_detached_t* defer_detached_run(defer_detached_t* d,
+                                     uint64_t max_ns,
+                                     size_t max_count);
+
 /**
  * @brief Execute all defers in the stack until the passed scope is
  * popped and
@@ -167,6 +412,136 @@ defer_scope_t* defer_scope_push(defer_scope_t* ds);
  */
 void defer_scope_pop(defer_scope_t* ds);
 
+/**
+ * A scope stack detached from any thread, see defer_stack_swap
+ */
+typedef struct defer_stack {
+    defer_scope_t* top;
+} defer_stack_t;
+
+#define DEFER_STACK_INIT \
+    { NULL }
+
+/**
+ * @brief Exchange the calling thread's scope stack with the one in stack
+ *
+ * Lets a user-space scheduler give every fiber or coroutine a stack of its
+ * own: swap the fiber's defer_stack_t in when switching to it and swap it out
+ * again when switching away, each stack is then pushed and popped only by its
+ * own fiber.  A fiber abandoned with scopes still on its stack can have them
+ * run by swapping it in and calling defer_scope_unwind(NULL).  Costs one
+ * thread-local load and store.
+ *
+ * @param stack stack to install, receives the one it replaces
+ */
+void defer_stack_swap(defer_stack_t* stack);
+
+/**
+ * @brief The innermost scope of the calling thread, the one defer uses
+ *
+ * @return the scope, the thread's root scope is pushed if it had none
+ */
+defer_scope_t* defer_scope_current(void);
+
+/**
+ * @brief Execute and unlink every scope above ds, leaving ds as the innermost
+ * scope, or every scope if ds is NULL
+ *
+ * @param ds a scope on this thread's stack
+ */
+void defer_scope_unwind(defer_scope_t* ds);
+
+#ifdef __GNUC__
+#define __DEFER_NORETURN __attribute__((noreturn))
+#else
+#define __DEFER_NORETURN
+#endif
+
+/**
+ * A setjmp point that remembers the scope stack, see defer_checkpoint
+ */
+typedef struct defer_checkpoint {
+    jmp_buf env;
+    defer_scope_t* scope;
+} defer_checkpoint_t;
+
+jmp_buf* __defer_checkpoint_mark(defer_checkpoint_t* cp);
+
+/**
+ * @brief setjmp that also records the innermost scope, returns 0 when called
+ * and the value passed to defer_longjmp when jumped to
+ *
+ * On a thread with no scope pushed the innermost scope is its root scope,
+ * created here if need be, which defer_longjmp never unwinds.
+ *
+ * Use like this:
+ * defer_checkpoint_t cp;
+ * if (defer_checkpoint(&cp)) {
+ *     // every scope pushed after the checkpoint has been run
+ *     return -1;
+ * }
+ * parse(input, &cp);
+ */
+#define defer_checkpoint(CP) setjmp(*__defer_checkpoint_mark(CP))
+
+/**
+ * @brief Run and unlink every scope pushed since cp was set, including stack
+ * scopes of DSNE frames, then longjmp back to it
+ *
+ * @param cp checkpoint set by a function that has not returned yet
+ * @param val value for defer_checkpoint to return, as for longjmp
+ */
+__DEFER_NORETURN void defer_longjmp(defer_checkpoint_t* cp, int val);
+
+/**
+ * What a child made by fork does with the scopes of the thread that forked,
+ * the only thread it has
+ *
+ * The scopes themselves stay on the child's stack for its frames to pop as
+ * usual.
+ * DEFER_FORK_RUN runs the defers of all but the thread's root scope as the
+ * child starts, the default, the root scope's run when the child exits.
+ * DEFER_FORK_DISCARD empties them without running anything, for children
+ * that go on to exec or _exit.
+ * DEFER_FORK_KEEP leaves them in place to be popped as usual, both processes
+ * then run the same defers.
+ */
+enum defer_fork_policy {
+    DEFER_FORK_RUN = 0,
+    DEFER_FORK_DISCARD,
+    DEFER_FORK_KEEP,
+};
+
+/**
+ * @brief Set the process-wide policy for the scopes of fork children
+ *
+ * @param policy how later forks treat the forking thread's scopes
+ */
+void defer_set_fork_policy(enum defer_fork_policy policy);
+
+/**
+ * What the scopes still on the stack of the thread that exits the process, and
+ * those a fork child runs under DEFER_FORK_RUN, do with their defers
+ *
+ * DEFER_EXIT_RUN runs them all, the default.
+ * DEFER_EXIT_FAST only runs the externally visible ones, flushes, unlinks,
+ * unlocks, closes and any callback not marked DEFER_MEMORY, and leaves the
+ * memory for the kernel to reclaim, so exiting with a large heap does not
+ * touch every page of it.  Scopes popped normally are not affected.
+ */
+enum defer_exit_policy {
+    DEFER_EXIT_RUN = 0,
+    DEFER_EXIT_FAST,
+};
+
+/**
+ * @brief Set the process-wide policy for defers run at exit and in fork
+ * children
+ *
+ * @param policy how later exits and forks treat memory-only defers
+ */
+void defer_set_exit_policy(enum defer_exit_policy policy);
+
 /**
  * @brief Defer execution of the free-like function fn, with
  * argument p, until
@@ -205,6 +580,31 @@ void defer_noarg(deferable_noarg fn);
  */
 defer_scope_t* defer_scope_new(void);
 
+/**
+ * @brief Create a new scope that *is not on the stack* and that any thread
+ * may defer into with defer_specific and friends
+ *
+ * Registration on a concurrent scope is a lock-free push of a node from the
+ * registering thread's cache, entries run newest first in the order the pushes
+ * landed.  Clearing or popping the scope must not race with registrations,
+ * typically the owning thread pops it after joining the threads that
+ * contributed to it.  Payloads are always heap copies on concurrent scopes.
+ *
+ * @return A new but un-registered concurrent scope
+ */
+defer_scope_t* defer_scope_new_concurrent(void);
+
+/**
+ * @brief Remove the innermost scope of the calling thread from its stack
+ * without running it, so that another thread can take it over with
+ * defer_scope_push
+ *
+ * @param ds the calling thread's innermost scope, or NULL for whichever that is
+ *
+ * @return the scope, now un-registered with its defers intact
+ */
+defer_scope_t* defer_scope_handoff(defer_scope_t* ds);
+
 /**
  * @brief Explicitly execute and clear scope. This may be safely
  * used on a
@@ -219,6 +619,10 @@ defer_scope_t* defer_scope_new(void);
  * `defer`, as in `defer(defer_scope_clear, ds)`, as can
  * `defer_scope_delete`.
  *
+ * The scope keeps any overflow blocks it had, so a long-lived scope that is
+ * cleared and refilled repeatedly does not allocate after the first cycle,
+ * they are released by defer_scope_delete or when the scope is popped.
+ *
  * @param ds The defer scope to clear
  */
 void defer_scope_clear(defer_scope_t* ds);
@@ -226,7 +630,8 @@ void defer_scope_clear(defer_scope_t* ds);
 /**
  * @brief Explicitly execute, clear and free scope.  This *must not*
  * be used
- * on a scope that has been pushed onto the stack.
+ * on a scope that has been pushed onto the stack.  Scopes in caller-provided
+ * storage are left empty rather than freed.
  *
  * @param ds A new but un-registered defer scope
  */
@@ -254,6 +659,582 @@ void defer_specific(defer_scope_t* ds, deferable_free_like fn, void* p);
  */
 void defer_specific_noarg(defer_scope_t* ds, deferable_noarg fn);
 
+/**
+ * @brief Defer execution of the free-like function fn, with argument p, until
+ * the nearest enclosing scope is cleared, with the given flags
+ *
+ * @param fn The free-like function to execute on cleanup
+ * @param p The user-defined value to pass to the function
+ * @param flags bitwise or of enum defer_flags values
+ */
+void defer_flags(deferable_free_like fn, void* p, unsigned flags);
+
+/**
+ * @brief defer_flags, but appending to the scope ds
+ *
+ * @param ds scope to append to
+ * @param fn function to execute on cleanup
+ * @param p argument to be passed to fn
+ * @param flags bitwise or of enum defer_flags values
+ */
+void defer_specific_flags(defer_scope_t* ds,
+                          deferable_free_like fn,
+                          void* p,
+                          unsigned flags);
+
+/**
+ * @brief Defer execution of the free-like function fn, with argument p, until
+ * the nearest enclosing scope is cleared, returning a handle that can cancel
+ * it
+ *
+ * Use for commit/rollback style code, defer the rollback and cancel it once
+ * the operation has succeeded:
+ * defer_handle_t undo = defer_cancelable(rollback, txn);
+ * ...
+ * defer_cancel(undo);
+ *
+ * @param fn The free-like function to execute on cleanup
+ * @param p The user-defined value to pass to the function
+ *
+ * @return a handle valid until the scope is cleared
+ */
+defer_handle_t defer_cancelable(deferable_free_like fn, void* p);
+
+/**
+ * @brief defer_cancelable, but appending to the scope ds
+ *
+ * @param ds scope to append to
+ * @param fn function to execute on cleanup
+ * @param p argument to be passed to fn
+ *
+ * @return a handle valid until the scope is cleared
+ */
+defer_handle_t defer_specific_cancelable(defer_scope_t* ds,
+                                         deferable_free_like fn,
+                                         void* p);
+
+/**
+ * @brief Disarm a defer registered with defer_cancelable so it does not run
+ * when its scope is cleared.  This is O(1), the entry is left in place and
+ * skipped.  The handle must not be used once its scope has been cleared.
+ *
+ * @param h handle to disarm
+ */
+static inline void defer_cancel(defer_handle_t h) {
+    h->kind = DEFER_KIND_NONE;
+    h->size = 0;
+}
+
+/**
+ * @brief Defer fn on every element of args, as though by a `defer(fn,
+ * args[i])` for each, until the nearest enclosing scope is cleared
+ *
+ * The arguments are copied into a single allocation and the whole batch takes
+ * one entry in the scope, at cleanup fn runs in a tight loop over the copy,
+ * last element first.
+ *
+ * @param fn The free-like function to execute on cleanup
+ * @param args array of n values to pass to fn
+ * @param n number of elements in args
+ */
+void defer_many(deferable_free_like fn, void* const* args, size_t n);
+
+/**
+ * @brief defer_many, but appending the batch to the scope ds
+ *
+ * @param ds scope to append to
+ * @param fn function to execute on cleanup
+ * @param args array of n values to pass to fn
+ * @param n number of elements in args
+ */
+void defer_specific_many(defer_scope_t* ds,
+                         deferable_free_like fn,
+                         void* const* args,
+                         size_t n);
+
+/**
+ * @brief Defer execution of fn on a copy of the size bytes at payload until the
+ * nearest enclosing scope is cleared
+ *
+ * Payloads of up to DEFER_PAYLOAD_MAX bytes are copied into the scope's own
+ * defer storage, so passing several values to a cleanup needs no allocation
+ * of its own.  The copy is aligned for pointers and 8-byte scalars.
+ *
+ * @param fn function to execute on cleanup, receives a pointer to the copy
+ * @param payload bytes to copy, or NULL to leave the copy uninitialized
+ * @param size size of the payload in bytes
+ *
+ * @return a pointer to the copy, which may be filled in or updated until the
+ * scope is cleared
+ */
+void* defer_payload(deferable_free_like fn, const void* payload, size_t size);
+
+/**
+ * @brief defer_payload, but appending the payload to the scope ds
+ *
+ * @param ds scope to append to
+ * @param fn function to execute on cleanup, receives a pointer to the copy
+ * @param payload bytes to copy, or NULL to leave the copy uninitialized
+ * @param size size of the payload in bytes
+ *
+ * @return a pointer to the copy
+ */
+void* defer_specific_payload(defer_scope_t* ds,
+                             deferable_free_like fn,
+                             const void* payload,
+                             size_t size);
+
+/**
+ * @brief Defer fn on a copy of a TYPE compound literal built from the
+ * remaining arguments
+ *
+ * Use like this:
+ * struct span { char *base; size_t len; };
+ * DEFER_WITH(unmap_span, struct span, .base = p, .len = n);
+ */
+#define DEFER_WITH(FN, TYPE, ...) \
+    defer_payload(FN, &(TYPE){__VA_ARGS__}, sizeof(TYPE))
+
+/**
+ * @brief Define a static function NAME taking ARG_LIST that defers a direct
+ * call FN(ARG_LIST) in the current scope
+ *
+ * The arguments are stored as a payload and FN is called from a generated
+ * trampoline with its own types, so functions that are not
+ * deferable_free_like can be deferred without casting them.  Use at file
+ * scope, ARG_LIST is types and names separated by commas as for DEFER_SCOPED.
+ *
+ * Use like this:
+ * DEFER_FUNCTION(defer_mprotect, mprotect, (void*, addr, size_t, len, int, prot));
+ * ...
+ * defer_mprotect(p, n, PROT_READ);
+ */
+#define DEFER_FUNCTION(NAME, FN, ARG_LIST)                                \
+    struct __defer_args_##NAME {                                          \
+        __DEFER_FIELDS ARG_LIST                                           \
+    };                                                                    \
+    static inline void __defer_call_##NAME(void* __defer_p) {             \
+        struct __defer_args_##NAME* __defer_a =                           \
+            (struct __defer_args_##NAME*)__defer_p;                       \
+        (void)FN(__DEFER_MEMBERS ARG_LIST);                               \
+    }                                                                     \
+    static inline void NAME __DEFER_ARGS ARG_LIST {                       \
+        struct __defer_args_##NAME __defer_a = {__DEFER_NAMES ARG_LIST};  \
+        defer_payload(__defer_call_##NAME, &__defer_a, sizeof __defer_a); \
+    }
+
+/**
+ * @brief Lock m and defer unlocking it in the current scope
+ *
+ * The unlock is stored as a dedicated entry in the scope's slots and released
+ * with a direct call to pthread_mutex_unlock, there is no allocation and no
+ * call through a function pointer.
+ * The scope must be popped on the thread that took the lock, so not with
+ * defer_scope_pop_async.
+ *
+ * @param m mutex to lock
+ *
+ * @return 0, or the error from pthread_mutex_lock in which case nothing is
+ * deferred
+ */
+int defer_lock(pthread_mutex_t* m);
+
+/**
+ * @brief Defer unlocking m, which the caller has already locked, in the
+ * current scope, with the same dedicated entry as defer_lock
+ */
+void defer_unlock(pthread_mutex_t* m);
+
+/**
+ * @brief Read lock l and defer unlocking it in the current scope, see
+ * defer_lock
+ *
+ * @return 0, or the error from pthread_rwlock_rdlock
+ */
+int defer_rdlock(pthread_rwlock_t* l);
+
+/**
+ * @brief Write lock l and defer unlocking it in the current scope, see
+ * defer_lock
+ *
+ * @return 0, or the error from pthread_rwlock_wrlock
+ */
+int defer_wrlock(pthread_rwlock_t* l);
+
+/**
+ * @brief Defer close(fd) in the current scope
+ *
+ * Like the lock guards these are dedicated entries rather than callbacks.
+ * When a scope is popped, runs of consecutive defer_close entries are sorted
+ * and contiguous descriptors closed with a single close_range where the kernel
+ * has it, runs of consecutive defer_munmap entries are merged where the
+ * mappings are adjacent, so a scope holding hundreds of descriptors or
+ * mappings does not tear down one syscall at a time.
+ */
+void defer_close(int fd);
+
+/**
+ * @brief Defer munmap(addr, len) in the current scope, see defer_close
+ */
+void defer_munmap(void* addr, size_t len);
+
+/**
+ * @brief Defer unlink(path) in the current scope
+ *
+ * path is copied into the scope's arena, so it need not outlive the call.
+ * Not for concurrent scopes.
+ *
+ * @return 0, or -1 if the copy could not be allocated in which case nothing
+ * is deferred
+ */
+int defer_unlink(const char* path);
+
+/**
+ * @brief Allocate memory owned by the scope ds, released all at once when ds
+ * is popped, cleared or deleted, after all of its defers have run
+ *
+ * Allocations are bump allocated from chunks of DEFER_ARENA_CHUNK bytes, with
+ * the alignment of malloc, larger ones get a chunk of their own.  Memory from
+ * the arena cannot be freed or reallocated individually.  Not for concurrent
+ * scopes.
+ *
+ * @param ds scope to allocate from
+ * @param size number of bytes to allocate
+ *
+ * @return the memory, or NULL if it could not be allocated
+ */
+void* defer_scope_alloc(defer_scope_t* ds, size_t size);
+
+/**
+ * @brief Allocate memory owned by the current scope, see defer_scope_alloc
+ *
+ * @param size number of bytes to allocate
+ *
+ * @return the memory, or NULL if it could not be allocated
+ */
+void* defer_alloc(size_t size);
+
+/**
+ * @brief Register the calling thread as a reader for defer_after_grace
+ *
+ * Registered threads hold back grace periods until they pass a quiescent
+ * point, by calling defer_quiescent or by popping their outermost scope, so
+ * they must do so regularly.  Threads are unregistered when they exit.
+ */
+void defer_thread_register(void);
+
+/**
+ * @brief Stop taking part in grace periods, callbacks this thread deferred
+ * with defer_after_grace still run once theirs have passed
+ */
+void defer_thread_unregister(void);
+
+/**
+ * @brief Announce that the calling thread holds no references obtained before
+ * this point, and run any of its defer_after_grace callbacks whose grace
+ * periods have passed
+ */
+void defer_quiescent(void);
+
+/**
+ * @brief Defer fn(p) until every registered thread has passed a quiescent
+ * point, for reclaiming objects that lock-free readers may still see
+ *
+ * Callbacks are batched per thread and run from a later defer_quiescent of
+ * the thread that deferred them.  Callbacks from unregistered threads run
+ * from any registered thread's, or immediately if there are none.
+ *
+ * @param fn The free-like function to execute
+ * @param p The argument to pass to fn
+ */
+void defer_after_grace(deferable_free_like fn, void* p);
+
+/**
+ * @brief Release cached overflow blocks held by the calling thread
+ *
+ * Scopes with more than DEFER_SCOPE_INLINE defers store the rest in blocks,
+ * blocks released by executed scopes are kept in a per-thread cache so that
+ * later defers do not have to allocate, as are the nodes used by concurrent
+ * scopes, counted at DEFER_BLOCK_ENTRIES nodes per block, and arena chunks,
+ * counted at their size in blocks.  The cache is
+ * released when the thread exits, this can be used to shrink it earlier on
+ * threads that go idle.
+ *
+ * @param keep number of cached blocks to retain
+ *
+ * @return the number of blocks and nodes freed
+ */
+size_t defer_cache_trim(size_t keep);
+
+/**
+ * @brief Set the maximum number of blocks the calling thread will cache,
+ * trimming the current cache down to it if necessary
+ *
+ * @param max new cap, 0 disables caching for this thread entirely
+ */
+void defer_cache_limit(size_t max);
+
+/* STATISTICS */
+
+#define DEFER_STATS_BUCKETS 32
+
+/**
+ * Totals across all threads, living and exited, see defer_stats_snapshot
+ */
+typedef struct defer_stats {
+    uint64_t defers;         // defers registered
+    uint64_t pushes;         // scopes pushed
+    uint64_t pops;           // scopes popped
+    uint64_t max_depth;      // deepest scope stack seen on any thread
+    uint64_t largest_scope;  // most defers run by a single scope pop
+    // pop_ns[i] counts defer_scope_pop calls that took [2^i, 2^(i+1)) ns
+    uint64_t pop_ns[DEFER_STATS_BUCKETS];
+} defer_stats_t;
+
+/**
+ * @brief Aggregate the per-thread statistics kept when libdefer is built with
+ * DEFER_STATS
+ *
+ * Counting costs a few relaxed stores per operation plus two clock reads per
+ * pop, and is compiled out entirely without DEFER_STATS.  Stats builds also
+ * disable the DEFER_INLINE fast path, as every operation must be counted by
+ * the library, so consumers should define DEFER_STATS as well.
+ *
+ * @param out filled with the totals, or zeroed
+ *
+ * @return false if the library was built without DEFER_STATS
+ */
+bool defer_stats_snapshot(defer_stats_t* out);
+
+/* TRACING
+ *
+ * When libdefer and its users are built with DEFER_TRACE the registration
+ * functions below become macros that record their call site in the defer,
+ * and every deferred callback runs between the enter and exit hooks
+ * installed with defer_set_hooks, if any.  Without DEFER_TRACE nothing is
+ * recorded, the hooks are never called and defer_t does not grow.  The
+ * library and everything using it must be built with the same setting, a
+ * mismatch fails to link.
+ */
+
+typedef struct defer_hooks {
+    void (*enter)(const defer_site_t* site, void* ctx);
+    void (*exit)(const defer_site_t* site, void* ctx);
+    void* ctx;
+} defer_hooks_t;
+
+/**
+ * @brief Install hooks to run around every deferred callback, in DEFER_TRACE
+ * builds
+ *
+ * Callbacks registered without a site, by calling a registration function
+ * through a pointer or with its name in parentheses, are reported with file
+ * "?" and line 0.
+ *
+ * @param hooks hooks to install, must stay valid until replaced, or NULL to
+ * remove them
+ */
+void defer_set_hooks(const defer_hooks_t* hooks);
+
+/**
+ * @brief Install hooks writing every deferred callback as a Chrome trace
+ * complete event, named after the callback and the site that deferred it,
+ * to the file at path
+ *
+ * @param path file to write, truncated
+ *
+ * @return false if the file could not be opened or the library was built
+ * without DEFER_TRACE
+ */
+bool defer_trace_chrome_open(const char* path);
+
+/**
+ * @brief Remove the Chrome trace hooks and finish and close their file
+ */
+void defer_trace_chrome_close(void);
+
+#if defined(DEFER_TRACE) && !defined(__DEFER_LIBRARY)
+
+extern __DEFER_TLS const defer_site_t* __defer_next_site;
+
+#define __DEFER_SITE(FN)                                                   \
+    ({                                                                     \
+        static const defer_site_t __defer_site = {__FILE__, __LINE__,      \
+                                                  __func__, #FN};          \
+        __defer_next_site = &__defer_site;                                 \
+    })
+
+/* the arguments after FN are passed through as they are, they may contain
+ * compound literals */
+#define defer(FN, ...) (__DEFER_SITE(FN), defer((FN), __VA_ARGS__))
+#define deferi(FN, ...) (__DEFER_SITE(FN), deferi((FN), __VA_ARGS__))
+#define defer_noarg(FN) (__DEFER_SITE(FN), defer_noarg(FN))
+#define defer_specific(DS, FN, ...) \
+    (__DEFER_SITE(FN), defer_specific((DS), (FN), __VA_ARGS__))
+#define defer_specific_noarg(DS, FN) \
+    (__DEFER_SITE(FN), defer_specific_noarg((DS), (FN)))
+#define defer_flags(FN, ...) (__DEFER_SITE(FN), defer_flags((FN), __VA_ARGS__))
+#define defer_cancelable(FN, ...) \
+    (__DEFER_SITE(FN), defer_cancelable((FN), __VA_ARGS__))
+#define defer_many(FN, ...) (__DEFER_SITE(FN), defer_many((FN), __VA_ARGS__))
+#define defer_payload(FN, ...) \
+    (__DEFER_SITE(FN), defer_payload((FN), __VA_ARGS__))
+#define defer_after_grace(FN, ...) \
+    (__DEFER_SITE(FN), defer_after_grace((FN), __VA_ARGS__))
+#define defer_lock(M) (__DEFER_SITE(pthread_mutex_unlock), defer_lock(M))
+#define defer_unlock(M) (__DEFER_SITE(pthread_mutex_unlock), defer_unlock(M))
+#define defer_rdlock(L) (__DEFER_SITE(pthread_rwlock_unlock), defer_rdlock(L))
+#define defer_wrlock(L) (__DEFER_SITE(pthread_rwlock_unlock), defer_wrlock(L))
+#define defer_close(FD) (__DEFER_SITE(close), defer_close(FD))
+#define defer_munmap(A, N) (__DEFER_SITE(munmap), defer_munmap(A, N))
+#define defer_unlink(P) (__DEFER_SITE(unlink), defer_unlink(P))
+
+#endif /* DEFER_TRACE */
+
+/* INLINE FAST PATH
+ *
+ * Defining DEFER_INLINE before including this header replaces defer,
+ * deferi, defer_noarg, defer_lock, defer_scope_push, defer_scope_pop,
+ * defer_scope_end and defer_stack_swap with static inline versions that work directly on the
+ * thread's scope stack, falling back to the library only to spill into
+ * overflow blocks, free heap scopes or unwind several scopes at once.  The
+ * DEFER_SCOPED family and DSNE/DSNEV pick these up automatically.  Requires
+ * the library to have been built as C11 and a compiler with thread-local
+ * storage.
+ */
+
+/**
+ * @brief Run a single defer entry, used by inline pops for entry kinds they do
+ * not handle themselves
+ *
+ * @return the number of payload slots below e to skip
+ */
+size_t __defer_run_entry(defer_t* e);
+
+#if defined(DEFER_INLINE) && !defined(DEFER_STATS) && !defined(DEFER_TRACE)
+
+extern __DEFER_TLS defer_scope_t* defer_scope_stack;
+// set by defer_thread_register, see defer_inline_pop
+extern __DEFER_TLS bool __defer_grace_reader;
+
+#ifdef __GNUC__
+#define __DEFER_UNLIKELY(X) __builtin_expect(!!(X), 0)
+#else
+#define __DEFER_UNLIKELY(X) (X)
+#endif
+
+static inline defer_scope_t* defer_inline_push(defer_scope_t* ds) {
+    defer_scope_t* top = defer_scope_stack;
+    // creating scopes and first push on a thread go through the library
+    if (__DEFER_UNLIKELY(!ds || !top))
+        return defer_scope_push(ds);
+    ds->parent = top;
+    defer_scope_stack = ds;
+    return ds;
+}
+
+static inline void defer_inline_pop(defer_scope_t* ds) {
+    defer_scope_t* top = defer_scope_stack;
+    if (!ds)
+        ds = top;
+    if (__DEFER_UNLIKELY(ds != top || top->overflow || top->spare ||
+                         top->arena || !top->parent ||
+                         top->flags & (DEFER_SCOPE_HEAP | DEFER_SCOPE_ROOT |
+                                       DEFER_SCOPE_UNORDERED) ||
+                         (__defer_grace_reader &&
+                          top->parent->flags & DEFER_SCOPE_ROOT))) {
+        defer_scope_pop(ds);
+        return;
+    }
+    for (unsigned i = top->count; i--;) {
+        defer_t* e = &top->routines[i];
+        if (e->kind == DEFER_KIND_ARG)
+            e->fn(e->data);
+        else if (e->kind == DEFER_KIND_NOARG)
+            e->noarg();
+        else if (e->kind == DEFER_KIND_MUTEX)
+            pthread_mutex_unlock((pthread_mutex_t*)e->data);
+        else
+            i -= __defer_run_entry(e);
+    }
+    defer_scope_stack = top->parent;
+    top->count = 0;
+    top->parent = NULL;
+}
+
+static inline void defer_inline(deferable_free_like fn, void* p) {
+    defer_scope_t* top = defer_scope_stack;
+    if (__DEFER_UNLIKELY(!top || top->count >= DEFER_SCOPE_INLINE ||
+                         top->flags & DEFER_SCOPE_CONCURRENT)) {
+        defer(fn, p);
+        return;
+    }
+    defer_t* e = &top->routines[top->count++];
+    e->fn = fn;
+    e->data = p;
+    e->kind = DEFER_KIND_ARG;
+}
+
+static inline void defer_inline_noarg(deferable_noarg fn) {
+    defer_scope_t* top = defer_scope_stack;
+    if (__DEFER_UNLIKELY(!top || top->count >= DEFER_SCOPE_INLINE ||
+                         top->flags & DEFER_SCOPE_CONCURRENT)) {
+        defer_noarg(fn);
+        return;
+    }
+    defer_t* e = &top->routines[top->count++];
+    e->noarg = fn;
+    e->kind = DEFER_KIND_NOARG;
+}
+
+static inline int defer_inline_lock(pthread_mutex_t* m) {
+    defer_scope_t* top = defer_scope_stack;
+    if (__DEFER_UNLIKELY(!top || top->count >= DEFER_SCOPE_INLINE ||
+                         top->flags & DEFER_SCOPE_CONCURRENT))
+        return defer_lock(m);
+    int err = pthread_mutex_lock(m);
+    if (__DEFER_UNLIKELY(err))
+        return err;
+    defer_t* e = &top->routines[top->count++];
+    e->data = m;
+    e->kind = DEFER_KIND_MUTEX;
+    return 0;
+}
+
+static inline void defer_inline_unlock(pthread_mutex_t* m) {
+    defer_scope_t* top = defer_scope_stack;
+    if (__DEFER_UNLIKELY(!top || top->count >= DEFER_SCOPE_INLINE ||
+                         top->flags & DEFER_SCOPE_CONCURRENT)) {
+        defer_unlock(m);
+        return;
+    }
+    defer_t* e = &top->routines[top->count++];
+    e->data = m;
+    e->kind = DEFER_KIND_MUTEX;
+}
+
+static inline void defer_inline_stack_swap(defer_stack_t* stack) {
+    defer_scope_t* top = defer_scope_stack;
+    defer_scope_stack = stack->top;
+    stack->top = top;
+}
+
+#define defer(FN, P) defer_inline((FN), (P))
+#define deferi(FN, P) defer_inline((FN), (void*)(intptr_t)(P))
+#define defer_noarg(FN) defer_inline_noarg(FN)
+#define defer_lock(M) defer_inline_lock(M)
+#define defer_unlock(M) defer_inline_unlock(M)
+#define defer_scope_push(DS) defer_inline_push(DS)
+#define defer_scope_pop(DS) defer_inline_pop(DS)
+#define defer_scope_end() defer_inline_pop(NULL)
+#define defer_stack_swap(S) defer_inline_stack_swap(S)
+
+#endif /* DEFER_INLINE */
+
+#ifdef __cplusplus
+}
+#endif
+
 /* HELPER MACROS, IGNORE THESE... */
 
 #define __DEFER_ARGS_INNER(T1, V1, ...) T1 V1 FOR_PAIRS(AS_ARGS, __VA_ARGS__)
@@ -266,4 +1247,16 @@ void defer_specific_noarg(defer_scope_t* ds, deferable_noarg fn);
 #define __DEFER_CALL(...) \
     (IFNEMPTY(__VA_ARGS__)(__DEFER_CALL_INNER(__VA_ARGS__)))
 
+#define __DEFER_NAMES(...) IFNEMPTY(__VA_ARGS__)(__DEFER_CALL_INNER(__VA_ARGS__))
+
+#define __DEFER_FIELDS(...) FOR_PAIRS(AS_FIELDS, __VA_ARGS__)
+
+#define __DEFER_AS_MEMBER(T, N) , __defer_a->N
+
+#define __DEFER_MEMBERS_INNER(T1, V1, ...) \
+    __defer_a->V1 FOR_PAIRS(__DEFER_AS_MEMBER, __VA_ARGS__)
+
+#define __DEFER_MEMBERS(...) \
+    IFNEMPTY(__VA_ARGS__)(__DEFER_MEMBERS_INNER(__VA_ARGS__))
+
 #endif
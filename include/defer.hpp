@@ -0,0 +1,142 @@
+#ifndef __DEFER_HPP
+#define __DEFER_HPP 1
+
+/* C++ companion to defer.h: capturing callables deferred on the same scope
+ * stack as the C code, in order with its defers, and a scope guard.
+ *
+ * Small trivially copyable callables are stored in the scope's own slots as a
+ * payload, anything else is constructed in the scope's arena, neither
+ * allocates in steady state.  Deferred callables must not throw, one that
+ * does terminates the program as a throwing destructor would.  Exceptions
+ * may unwind through scope guards and DEFER_SCOPED functions, but not
+ * through C frames with stack scopes (DSNE), the guard would then pop scopes
+ * whose memory is gone.
+ */
+
+#include "defer.h"
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace libdefer {
+
+namespace detail {
+
+// arena and heap memory have malloc's alignment, over-allocate for more
+template <class F>
+struct padding
+    : std::integral_constant<std::size_t,
+                             (alignof(F) > alignof(std::max_align_t)
+                                  ? alignof(F)
+                                  : 0)> {};
+
+template <class F>
+F* aligned(void* p) {
+    std::size_t space = sizeof(F) + padding<F>::value;
+    return static_cast<F*>(std::align(alignof(F), sizeof(F), p, space));
+}
+
+template <class F>
+void run(void* p) noexcept {
+    F* f = static_cast<F*>(p);
+    (*f)();
+    f->~F();
+}
+
+template <class F>
+void run_aligned(void* p) noexcept {
+    run<F>(aligned<F>(p));
+}
+
+template <class F>
+struct in_slots
+    : std::integral_constant<bool,
+                             sizeof(F) <= DEFER_PAYLOAD_MAX &&
+                                 alignof(F) <= alignof(defer_t) &&
+                                 std::is_trivially_copyable<F>::value> {};
+
+// the entry exists before f is moved in, a throwing move cannot be undone
+template <class F>
+void emplace(void* p, F&& f) noexcept {
+    new (p) F(std::move(f));
+}
+
+// payload slots are moved with memcpy, only trivially copyable types go there
+template <class F>
+void later(defer_scope_t* ds, F&& f, std::true_type) {
+    emplace(defer_specific_payload(ds, run<F>, NULL, sizeof(F)),
+            std::move(f));
+}
+
+template <class F>
+void later(defer_scope_t* ds, F&& f, std::false_type) {
+    std::size_t size = sizeof(F) + padding<F>::value;
+    if (ds->flags & DEFER_SCOPE_CONCURRENT) {
+        // payloads of concurrent scopes always live on the heap
+        void* p = defer_specific_payload(ds, run_aligned<F>, NULL, size);
+        emplace(aligned<F>(p), std::move(f));
+        return;
+    }
+    void* p = defer_scope_alloc(ds, size);
+    if (!p)
+        throw std::bad_alloc();
+    F* obj = new (aligned<F>(p)) F(std::move(f));
+    defer_specific(ds, run<F>, obj);
+}
+
+}  // namespace detail
+
+/**
+ * @brief Defer the callable f, called with no arguments, in the scope ds
+ *
+ * @param ds scope to defer into
+ * @param f callable to move into the scope
+ */
+template <class F>
+void later(defer_scope_t* ds, F&& f) {
+    typedef typename std::decay<F>::type T;
+    T callable(std::forward<F>(f));
+    detail::later<T>(ds, std::move(callable),
+                     std::integral_constant<bool, detail::in_slots<T>::value>());
+}
+
+/**
+ * @brief Defer the callable f in the current scope, see later(ds, f)
+ */
+template <class F>
+void later(F&& f) {
+    later(defer_scope_current(), std::forward<F>(f));
+}
+
+/**
+ * @brief A stack scope pushed on construction and popped, running its defers,
+ * on destruction, including by an exception unwinding through it
+ */
+class scope {
+   public:
+    scope() { defer_scope_push(defer_scope_init(&ds_)); }
+    ~scope() { defer_scope_pop(&ds_); }
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+    defer_scope_t* get() { return &ds_; }
+
+    /**
+     * @brief Defer f in this scope
+     */
+    template <class F>
+    void later(F&& f) {
+        libdefer::later(&ds_, std::forward<F>(f));
+    }
+
+   private:
+    defer_scope_t ds_;
+};
+
+}  // namespace libdefer
+
+#endif /* __DEFER_HPP */
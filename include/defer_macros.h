@@ -157,4 +157,6 @@ _IFNEMPTY(                                                               \
 
 #define AS_TYPES(T, N) , T
 
+#define AS_FIELDS(T, N) T N;
+
 #endif /* __FU_MACROS_H */
@@ -0,0 +1,121 @@
+#ifndef __DEFER_TYPED_H
+#define __DEFER_TYPED_H
+
+/* Typed cleanups for the common cases.  The defer_* forms register a direct
+ * call through a trampoline of the right type, or a dedicated entry, no
+ * casting the cleanup function to deferable_free_like.  The DEFER_AUTO_*
+ * forms do not touch the scope at all, they use __attribute__((cleanup)) to
+ * run the cleanup when the enclosing block exits, which compiles to a direct
+ * call on every path out of the block but is neither run by defer_scope_pop
+ * nor by longjmp.
+ */
+
+#include "defer.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static inline void __defer_fclose(void* f) {
+    fclose((FILE*)f);
+}
+
+/**
+ * @brief Defer fclose(f) in the current scope
+ */
+static inline void defer_fclose(FILE* f) {
+    defer(__defer_fclose, f);
+}
+
+/**
+ * @brief Defer close(fd) in the current scope, batched with its neighbours,
+ * see defer_close
+ */
+static inline void defer_close_fd(int fd) {
+    defer_close(fd);
+}
+
+/**
+ * @brief Defer pthread_mutex_unlock(m) in the current scope, as the same
+ * dedicated entry defer_lock stores, see defer_unlock
+ */
+static inline void defer_mutex_unlock(pthread_mutex_t* m) {
+    defer_unlock(m);
+}
+
+static inline void __defer_release_free(void* p) {
+    defer(free, p);
+}
+
+/* Never defined, the argument-less prototype makes defer_release of any type
+ * it does not list a compile-time error rather than a free */
+void __defer_release_unsupported_type(void);
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+/**
+ * @brief Defer the release of X picked by its type: fclose for a FILE*,
+ * pthread_mutex_unlock for a pthread_mutex_t*, close for an int file
+ * descriptor, batched like defer_close, and free for a void* or char*, which
+ * must come from malloc.  Any other type does not compile.
+ */
+#define defer_release(X)                           \
+    _Generic((X),                                  \
+             FILE*: defer_fclose,                  \
+             pthread_mutex_t*: defer_mutex_unlock, \
+             int: defer_close_fd,                  \
+             void*: __defer_release_free,          \
+             char*: __defer_release_free,          \
+             default: __defer_release_unsupported_type)(X)
+#endif
+
+static inline void __defer_auto_free(void* p) {
+    free(*(void**)p);
+}
+
+static inline void __defer_auto_fclose(FILE** f) {
+    if (*f)
+        fclose(*f);
+}
+
+static inline void __defer_auto_close(int* fd) {
+    if (*fd >= 0)
+        close(*fd);
+}
+
+static inline void __defer_auto_unlock(pthread_mutex_t** m) {
+    pthread_mutex_unlock(*m);
+}
+
+/**
+ * @brief Attribute for a pointer variable to free at the end of its block
+ *
+ * Use like this:
+ * DEFER_AUTO_FREE char* buf = malloc(n);
+ */
+#define DEFER_AUTO_FREE __attribute__((cleanup(__defer_auto_free)))
+
+/**
+ * @brief Attribute for a FILE* variable to fclose at the end of its block,
+ * unless it is NULL
+ */
+#define DEFER_AUTO_FCLOSE __attribute__((cleanup(__defer_auto_fclose)))
+
+/**
+ * @brief Attribute for an int file descriptor variable to close at the end of
+ * its block, unless it is negative
+ */
+#define DEFER_AUTO_CLOSE __attribute__((cleanup(__defer_auto_close)))
+
+/**
+ * @brief Unlock the mutex M, which the caller has locked, at the end of the
+ * enclosing block
+ */
+#define DEFER_AUTO_UNLOCK(M)                                          \
+    pthread_mutex_t* __DEFER_AUTO_NAME(__defer_unlock_, __LINE__)      \
+        __attribute__((cleanup(__defer_auto_unlock), unused)) = (M)
+
+#define __DEFER_AUTO_NAME(A, B) __DEFER_AUTO_NAME_(A, B)
+#define __DEFER_AUTO_NAME_(A, B) A##B
+
+#endif /* __DEFER_TYPED_H */
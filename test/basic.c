@@ -23,6 +23,33 @@ void check_order(void *n) {
     printf("order observed %ld\n", ctr - (intptr_t)n);
 }
 
+struct span {
+    intptr_t expect;
+    intptr_t add;
+    char pad[48];
+};
+
+void add_deref(void* p) {
+    ctr += *(intptr_t*)p;
+}
+
+void check_span(void* p) {
+    struct span* s = (struct span*)p;
+    check_order((void*)s->expect);
+    ctr += s->add;
+}
+
+defer_checkpoint_t* bail;
+
+DSNEV(descend, (int, depth)) {
+    deferi(add, 1);
+    defer_scope_push(NULL);  // and a heap scope for good measure
+    deferi(add, 1);
+    if (!depth)
+        defer_longjmp(bail, 7);
+    descend(depth - 1);
+}
+
 DEFER_SCOPED_VOID(t1, ()){
     deferi(check_order, 1);
     defer_noarg(add_one);
@@ -36,11 +63,163 @@ DEFER_SCOPED_VOID(t2, (int, a)){
     assert(ctr == 1);
 }
 
+DSNEV(t3, (int, n)){
+    // enough to spill out of the scope into overflow blocks
+    deferi(check_order, 6 + n);
+    for (int i = 0; i < n; ++i)
+        defer_noarg(add_one);
+    assert(ctr == 6);
+}
+
 int main(int argc, char *argv[])
 {
     t1();
     t2(5);
     assert(ctr == 6);
+    t3(64);
+    assert(ctr == 70);
+
+    // unwind a heap scope and a stack scope above it with one handle, then
+    // reuse the stack scope
+    defer_scope_t stack_scope[1];
+    defer_scope_t* outer = defer_scope_begin();
+    deferi(check_order, 71);
+    defer_scope_push(defer_scope_init(stack_scope));
+    deferi(add, 1);
+    defer_scope_pop(outer);
+    defer_scope_push(stack_scope);
+    deferi(add, 1);
+    defer_scope_pop(stack_scope);
+    assert(ctr == 72);
+    ctr = 70;
+
+    // a batch runs like the equivalent loop of defers
+    defer_scope_begin();
+    void* batch[99];
+    for (int i = 0; i < 99; ++i)
+        batch[i] = (void*)(intptr_t)1;
+    deferi(check_order, 70 + 99);
+    defer_many(add, batch, 99);
+    defer_scope_end();
+    assert(ctr == 70 + 99);
+    ctr = 70;
+
+    // payloads too big for the inline slots left keep their order
+    defer_scope_begin();
+    deferi(check_order, 76);
+    deferi(add, 2);
+    DEFER_WITH(check_span, struct span, .expect = 73, .add = 1);
+    struct span* late = defer_payload(check_span, NULL, sizeof *late);
+    late->expect = 72;
+    late->add = 1;
+    DEFER_WITH(check_span, struct span, .expect = 70, .add = 2);
+    defer_scope_end();
+    assert(ctr == 76);
+    ctr = 70;
+
+    // cancelled defers stay in place but are skipped
+    defer_scope_begin();
+    deferi(check_order, 71);
+    defer_handle_t undo = defer_cancelable(add, (void*)100);
+    deferi(add, 1);
+    defer_cancel(undo);
+    defer_scope_end();
+    assert(ctr == 71);
+    ctr = 70;
+
+    // a detached scope reused across cycles keeps its blocks to itself
+    defer_scope_t* detached = defer_scope_new();
+    for (int cycle = 0; cycle < 3; ++cycle) {
+        for (int i = 0; i < 40; ++i)
+            defer_specific_noarg(detached, add_one);
+        defer_scope_clear(detached);
+        assert(ctr == 70 + 40 * (cycle + 1));
+        assert(detached->spare && !detached->overflow);
+    }
+    defer_scope_delete(detached);
+    ctr = 70;
+
+    // a budgeted pop unlinks the scope at once and runs it newest first, a
+    // slice at a time
+    defer_scope_t* sliced = defer_scope_begin();
+    deferi(check_order, 70 + 100 + 3);
+    DEFER_WITH(check_span, struct span, .expect = 70 + 100, .add = 3);
+    for (int i = 0; i < 100; ++i)
+        deferi(add, 1);
+    defer_scope_t* parent = sliced->parent;
+    defer_detached_t* rest = defer_scope_pop_budget(sliced, 0, 10);
+    assert(rest && ctr == 80 && defer_scope_current() == parent);
+    int slices = 0;
+    while ((rest = defer_detached_run(rest, 0, 10)))
+        slices++;
+    assert(slices == 9 && ctr == 70 + 100 + 3);
+    ctr = 70;
+    defer_scope_begin();
+    for (int i = 0; i < 100; ++i)
+        deferi(add, 1);
+    rest = defer_scope_pop_budget(NULL, 1, 0);
+    assert(rest && ctr == 70 + DEFER_BUDGET_CLOCK_EVERY);
+    assert(!defer_detached_run(rest, 0, 0) && ctr == 170);
+    ctr = 70;
+
+    // lock guards release in order with the other defers
+    pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+    pthread_rwlock_t rw = PTHREAD_RWLOCK_INITIALIZER;
+    defer_scope_begin();
+    assert(defer_lock(&m) == 0);
+    assert(defer_rdlock(&rw) == 0);
+    assert(defer_rdlock(&rw) == 0);
+    assert(pthread_mutex_trylock(&m) != 0);
+    assert(pthread_rwlock_trywrlock(&rw) != 0);
+    defer_scope_end();
+    assert(pthread_mutex_trylock(&m) == 0);
+    pthread_mutex_unlock(&m);
+    defer_scope_begin();
+    for (int i = 0; i < DEFER_SCOPE_INLINE; ++i)
+        deferi(add, 1);
+    assert(defer_lock(&m) == 0);
+    assert(defer_wrlock(&rw) == 0);
+    defer_scope_end();
+    assert(pthread_rwlock_trywrlock(&rw) == 0);
+    pthread_rwlock_unlock(&rw);
+    assert(pthread_mutex_trylock(&m) == 0);
+    pthread_mutex_unlock(&m);
+    ctr = 70;
+
+    // a longjmp through DSNE frames runs all of their scopes
+    defer_checkpoint_t cp;
+    defer_scope_t* guard = defer_scope_begin();
+    deferi(check_order, 70 + 2 * 101);
+    volatile int jumped = 0;
+    if (defer_checkpoint(&cp) == 0) {
+        bail = &cp;
+        descend(100);
+    } else {
+        jumped = 1;
+    }
+    assert(jumped && ctr == 70 + 2 * 101);
+    defer_scope_pop(guard);
+    ctr = 70;
+
+    // arena memory outlives every defer of its scope
+    defer_scope_begin();
+    intptr_t* small = (intptr_t*)defer_alloc(sizeof *small);
+    char* big = (char*)defer_alloc(64 * 1024);
+    long double* aligned = (long double*)defer_alloc(sizeof *aligned);
+    assert(small && big && aligned);
+    assert(!defer_alloc(SIZE_MAX - 4));
+    assert((uintptr_t)aligned % _Alignof(long double) == 0);
+    *small = 3;
+    big[64 * 1024 - 1] = 4;
+    defer(add_deref, small);
+    defer_scope_end();
+    assert(ctr == 73);
+    ctr = 70;
+
+    // the overflow blocks and the arena chunk went back to this thread's cache
+    assert(defer_cache_trim(1) == 5);
+    defer_cache_limit(0);
+    assert(defer_cache_trim(0) == 0);
     
-    return ctr - 6;
+    return ctr - 70;
 }
@@ -0,0 +1,73 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <defer.hpp>
+
+static std::vector<std::string> log_;
+
+extern "C" void log_c(void* s) {
+    log_.push_back(static_cast<const char*>(s));
+}
+
+struct alignas(64) wide {
+    char bytes[64];
+};
+
+static void work(bool fail) {
+    libdefer::scope s;
+    int a = 1;
+    s.later([&] { log_.push_back("small " + std::to_string(a)); });
+    defer(log_c, (void*)"c");
+    std::string big(100, 'x');
+    s.later([big] { log_.push_back("big " + std::to_string(big.size())); });
+    wide w;
+    w.bytes[0] = 7;
+    s.later([w] {
+        assert(reinterpret_cast<std::uintptr_t>(&w) % 64 == 0);
+        log_.push_back("wide " + std::to_string(w.bytes[0]));
+    });
+    if (fail)
+        throw std::runtime_error("fail");
+}
+
+int main() {
+    work(false);
+    std::vector<std::string> expect = {"wide 7", "big 100", "c", "small 1"};
+    assert(log_ == expect);
+
+    // an exception unwinding through the guard runs its defers
+    log_.clear();
+    try {
+        work(true);
+        assert(false);
+    } catch (const std::runtime_error&) {
+        assert(log_ == expect);
+    }
+
+    // without a guard, into whatever scope is current, C or C++
+    log_.clear();
+    defer_scope_t* ds = defer_scope_begin();
+    libdefer::later([] { log_.push_back("current"); });
+    defer_scope_pop(ds);
+    assert(log_ == std::vector<std::string>{"current"});
+
+    // concurrent scopes keep their callables on the heap
+    log_.clear();
+    defer_scope_t* shared = defer_scope_new_concurrent();
+    wide w;
+    w.bytes[0] = 9;
+    libdefer::later(shared, [w] {
+        assert(reinterpret_cast<std::uintptr_t>(&w) % 64 == 0);
+        log_.push_back("shared " + std::to_string(w.bytes[0]));
+    });
+    libdefer::later(shared, [] { log_.push_back("shared small"); });
+    defer_scope_delete(shared);
+    assert((log_ == std::vector<std::string>{"shared small", "shared 9"}));
+    return 0;
+}
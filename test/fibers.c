@@ -0,0 +1,106 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ucontext.h>
+#include <defer.h>
+
+#define FIBERS 3
+#define ROUNDS 4
+
+struct fiber {
+    ucontext_t ctx;
+    defer_stack_t defers;
+    int id;
+    long sum;
+    char stack[64 * 1024];
+};
+
+static ucontext_t sched;
+static struct fiber fibers[FIBERS];
+static struct fiber* current;
+
+void add_to(void* f) {
+    // runs on the fiber that registered it, and only then
+    assert(current == (struct fiber*)f);
+    current->sum += current->id;
+}
+
+static int root_ran = 0;
+
+void root_done(void) {
+    assert(current == NULL);
+    root_ran++;
+}
+
+static void yield(void) {
+    swapcontext(&current->ctx, &sched);
+}
+
+DSNEV(nest, (int, rounds)) {
+    defer(add_to, current);
+    yield();
+    if (rounds > 1)
+        nest(rounds - 1);
+    yield();
+}
+
+static void fiber_main(void) {
+    nest(ROUNDS);
+}
+
+// a scheduler that swaps each fiber's scope stack in with its context
+static void run(struct fiber* f) {
+    current = f;
+    defer_stack_swap(&f->defers);
+    swapcontext(&sched, &f->ctx);
+    defer_stack_swap(&f->defers);
+    current = NULL;
+}
+
+int main(int argc, char* argv[]) {
+    defer_scope_t root;
+    defer_scope_push(defer_scope_init(&root));
+    defer_noarg(root_done);
+
+    for (int i = 0; i < FIBERS; ++i) {
+        struct fiber* f = &fibers[i];
+        getcontext(&f->ctx);
+        f->ctx.uc_stack.ss_sp = f->stack;
+        f->ctx.uc_stack.ss_size = sizeof f->stack;
+        f->ctx.uc_link = &sched;
+        makecontext(&f->ctx, fiber_main, 0);
+        f->defers = (defer_stack_t)DEFER_STACK_INIT;
+        f->id = i + 1;
+    }
+    // interleave the fibers' scopes on this one thread
+    for (int round = 0; round < 2 * ROUNDS + 1; ++round)
+        for (int i = 0; i < FIBERS; ++i)
+            run(&fibers[i]);
+    for (int i = 0; i < FIBERS; ++i) {
+        assert(fibers[i].sum == ROUNDS * fibers[i].id);
+        assert(fibers[i].defers.top == NULL);
+    }
+
+    // an abandoned fiber's scopes run when unwound on its stack
+    struct fiber* f = &fibers[0];
+    f->sum = 0;
+    getcontext(&f->ctx);
+    makecontext(&f->ctx, fiber_main, 0);
+    run(f);
+    run(f);
+    assert(f->sum == 0 && f->defers.top);
+    current = f;
+    defer_stack_swap(&f->defers);
+    defer_scope_unwind(NULL);
+    defer_stack_swap(&f->defers);
+    assert(f->sum == 2 && f->defers.top == NULL);
+
+    current = NULL;
+    defer_scope_pop(&root);
+    assert(root_ran == 1);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <defer.h>
+
+void nop(void* unused) {
+}
+
+DSNEV(nest, (int, depth, int, defers)) {
+    for (int i = 0; i < defers; ++i)
+        defer(nop, NULL);
+    if (depth > 1)
+        nest(depth - 1, defers);
+}
+
+void* worker(void* unused) {
+    defer_scope_begin();
+    nest(2, 3);
+    defer_scope_end();
+    return NULL;
+}
+
+// defers into its root scope, which only runs as the thread exits
+void* rooted(void* unused) {
+    defer(nop, NULL);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    defer_stats_t before, after;
+    assert(defer_stats_snapshot(&before));
+
+    // a scope's size is in defers, not the slots payloads take
+    char payload[DEFER_PAYLOAD_MAX] = {0};
+    defer_scope_begin();
+    for (int i = 0; i < 3; ++i)
+        defer_payload(nop, payload, sizeof payload);
+    defer_scope_end();
+    defer_stats_t sized;
+    assert(defer_stats_snapshot(&sized));
+    assert(sized.largest_scope == 3);
+
+    nest(5, 2);
+    defer_scope_begin();
+    for (int i = 0; i < 100; ++i)
+        defer(nop, NULL);
+    defer_scope_end();
+
+    // counts from exited threads are kept
+    pthread_t t;
+    pthread_create(&t, NULL, worker, NULL);
+    pthread_join(t, NULL);
+    pthread_create(&t, NULL, rooted, NULL);
+    pthread_join(t, NULL);
+
+    // depth is tracked per stack, from nothing on a fresh one
+    defer_stack_t fiber = DEFER_STACK_INIT;
+    defer_stack_swap(&fiber);
+    nest(7, 0);
+    defer_stack_swap(&fiber);
+
+    assert(defer_stats_snapshot(&after));
+    printf("defers %lu pushes %lu pops %lu depth %lu largest %lu\n",
+           (unsigned long)(after.defers - before.defers),
+           (unsigned long)(after.pushes - before.pushes),
+           (unsigned long)(after.pops - before.pops),
+           (unsigned long)after.max_depth,
+           (unsigned long)after.largest_scope);
+    assert(after.defers - before.defers == 3 + 5 * 2 + 100 + 2 * 3 + 1);
+    // the rooted thread's root scope is counted, its pop at thread exit too
+    assert(after.pushes - before.pushes == 1 + 5 + 1 + 3 + 1 + 7);
+    assert(after.pops - before.pops == 1 + 5 + 1 + 3 + 1 + 7);
+    // the seven on the fiber's stack, not the root scope plus five nested
+    assert(after.max_depth == 7);
+    assert(after.largest_scope == 100);
+    uint64_t timed = 0;
+    for (int i = 0; i < DEFER_STATS_BUCKETS; ++i)
+        timed += after.pop_ns[i] - before.pop_ns[i];
+    assert(timed == 1 + 5 + 1 + 3 + 1 + 7);
+    return 0;
+}
@@ -0,0 +1,370 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <defer.h>
+
+#define WORKERS 4
+#define PER_WORKER 1000
+
+long ctr = 0;
+
+void add(void* i) {
+    ctr += (intptr_t)i;
+}
+
+void check_order(void* n) {
+    assert(ctr == (intptr_t)n);
+    printf("order observed %ld\n", ctr - (intptr_t)n);
+}
+
+void* contribute(void* ds) {
+    for (int i = 0; i < PER_WORKER; ++i)
+        defer_specific((defer_scope_t*)ds, add, (void*)1);
+    return NULL;
+}
+
+// fork/join, every worker defers into the request's scope, the owner pops
+void fork_join(void) {
+    pthread_t workers[WORKERS];
+    defer_scope_t* request = defer_scope_push(defer_scope_new_concurrent());
+    deferi(check_order, WORKERS * PER_WORKER);
+    for (int i = 0; i < WORKERS; ++i)
+        pthread_create(&workers[i], NULL, contribute, request);
+    for (int i = 0; i < WORKERS; ++i)
+        pthread_join(workers[i], NULL);
+    assert(ctr == 0);
+    defer_scope_pop(request);
+    assert(ctr == WORKERS * PER_WORKER);
+}
+
+void* refill(void* ds) {
+    defer_specific((defer_scope_t*)ds, add, (void*)1);
+    return (void*)(intptr_t)defer_cache_trim(0);
+}
+
+// the nodes fork_join's owner popped past its own cache went to the depot, a
+// new worker takes a run of them rather than allocating its one node
+void depot_refill(void) {
+    pthread_t worker;
+    void* cached;
+    defer_scope_t* request = defer_scope_push(defer_scope_new_concurrent());
+    pthread_create(&worker, NULL, refill, request);
+    pthread_join(worker, &cached);
+    assert((intptr_t)cached > 0);
+    defer_scope_pop(request);
+}
+
+void* adopt(void* ds) {
+    defer_scope_push((defer_scope_t*)ds);
+    deferi(add, 1);
+    defer_scope_pop(ds);
+    return NULL;
+}
+
+// a scope started on this thread and finished on another
+void handoff(void) {
+    pthread_t t;
+    defer_scope_begin();
+    deferi(check_order, 2);
+    deferi(add, 1);
+    defer_scope_t* ds = defer_scope_handoff(NULL);
+    pthread_create(&t, NULL, adopt, ds);
+    pthread_join(t, NULL);
+    assert(ctr == 2);
+}
+
+void* bare(void* n) {
+    // no scope pushed on this thread, it gets its root scope
+    for (intptr_t i = 0; i < (intptr_t)n; ++i)
+        defer(add, (void*)1);
+    return NULL;
+}
+
+void* bare_exit(void* n) {
+    defer_scope_begin();
+    defer(add, n);
+    pthread_exit(NULL);
+}
+
+// defers of exiting threads run, however they exit, and a churning pool of
+// threads reuses the blocks of the ones before it
+void thread_exit(void) {
+    for (int i = 0; i < 8; ++i) {
+        pthread_t t;
+        pthread_create(&t, NULL, bare, (void*)100);
+        pthread_join(t, NULL);
+    }
+    assert(ctr == 800);
+    pthread_t t;
+    pthread_create(&t, NULL, bare_exit, (void*)5);
+    pthread_join(t, NULL);
+    assert(ctr == 805);
+}
+
+// the child's exit status is ctr right after the fork, then after unwinding,
+// it leaves through exit so the atexit cleanup sees its emptied stack
+static int forked(enum defer_fork_policy policy) {
+    defer_set_fork_policy(policy);
+    ctr = 0;
+    defer_scope_t* ds = defer_scope_begin();
+    deferi(add, 1);
+    fflush(NULL);
+    pid_t pid = fork();
+    if (!pid) {
+        long at_start = ctr;
+        defer_scope_unwind(NULL);
+        exit(at_start * 10 + ctr);
+    }
+    defer_scope_pop(ds);
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+DSNE(pid_t, fork_inside, (long*, seen)) {
+    deferi(add, 1);
+    fflush(NULL);
+    pid_t pid = fork();
+    if (!pid)
+        *seen = ctr;
+    return pid;
+}
+
+// a child forked inside a DSNE frame runs the frame's defers as it starts and
+// then pops the emptied scope on return like the parent
+static int forked_in_frame(void) {
+    defer_set_fork_policy(DEFER_FORK_RUN);
+    ctr = 0;
+    long seen = -1;
+    pid_t pid = fork_inside(&seen);
+    if (!pid)
+        exit(seen * 10 + ctr);
+    assert(ctr == 1);
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+int exit_pipe[2];
+
+void say(void* c) {
+    char ch = (char)(intptr_t)c;
+    assert(write(exit_pipe[1], &ch, 1) == 1);
+}
+
+// the child forks a grandchild and exits with its scope still pushed, both
+// run it on the way out, minus the memory-only defers under DEFER_EXIT_FAST
+static void exited(enum defer_exit_policy policy, const char* expect) {
+    assert(pipe(exit_pipe) == 0);
+    fflush(NULL);
+    pid_t pid = fork();
+    if (!pid) {
+        close(exit_pipe[0]);
+        defer_set_exit_policy(policy);
+        defer_set_fork_policy(DEFER_FORK_RUN);
+        defer_scope_begin();
+        defer(say, (void*)'x');
+        defer(free, malloc(64));
+        defer_flags(say, (void*)'m', DEFER_MEMORY);
+        pid_t grandchild = fork();
+        if (!grandchild)
+            _exit(0);
+        waitpid(grandchild, NULL, 0);
+        exit(0);
+    }
+    close(exit_pipe[1]);
+    char got[8] = {0};
+    size_t n = 0;
+    ssize_t r;
+    while ((r = read(exit_pipe[0], got + n, sizeof got - 1 - n)) > 0)
+        n += r;
+    close(exit_pipe[0]);
+    waitpid(pid, NULL, 0);
+    assert(strcmp(got, expect) == 0);
+}
+
+long seq = 0;
+long hits = 0;
+
+void check_seq(void* n) {
+    assert(seq == (intptr_t)n);
+    seq++;
+}
+
+void hit(void* seven) {
+    assert(*(long*)seven == 7);
+    __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+}
+
+// ordered defers keep their order on the pool, unordered ones all run, the
+// arena is only released after them
+void async(void) {
+    defer_async_workers(WORKERS);
+    defer_scope_t* ds = defer_scope_begin();
+    for (int i = 0; i < PER_WORKER; ++i) {
+        deferi(check_seq, PER_WORKER - 1 - i);
+        long* seven = (long*)defer_alloc(sizeof *seven);
+        *seven = 7;
+        for (int j = 0; j < WORKERS; ++j)
+            defer_flags(hit, seven, DEFER_UNORDERED);
+    }
+    defer_scope_pop_async(ds);
+    defer_async_drain();
+    assert(seq == PER_WORKER);
+    assert(hits == WORKERS * PER_WORKER);
+}
+
+struct node {
+    long valid;
+};
+
+struct node* shared;
+int stop = 0;
+int registered = 0;
+long reclaimed = 0;
+
+void retire(void* p) {
+    struct node* n = (struct node*)p;
+    n->valid = 0;
+    free(n);
+    reclaimed++;
+}
+
+// one reader passes quiescent points explicitly, the other by popping its
+// outermost scope down to its root scope, a stack scope so that built with
+// DEFER_INLINE the pop is the inline one
+void* reader(void* scoped) {
+    defer_thread_register();
+    if (scoped)
+        defer(free, malloc(1));
+    __atomic_fetch_add(&registered, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        defer_scope_t s;
+        defer_scope_t* ds =
+            scoped ? defer_scope_push(defer_scope_init(&s)) : NULL;
+        struct node* n = __atomic_load_n(&shared, __ATOMIC_ACQUIRE);
+        assert(n->valid == 1);
+        if (ds)
+            defer_scope_pop(ds);
+        else
+            defer_quiescent();
+    }
+    return NULL;
+}
+
+// no reader ever sees a node after its grace period has run
+void grace(void) {
+    defer_thread_register();
+    shared = (struct node*)malloc(sizeof *shared);
+    shared->valid = 1;
+    pthread_t readers[2];
+    for (intptr_t i = 0; i < 2; ++i)
+        pthread_create(&readers[i], NULL, reader, (void*)i);
+    while (__atomic_load_n(&registered, __ATOMIC_ACQUIRE) < 2)
+        sched_yield();
+    for (int i = 0; i < PER_WORKER; ++i) {
+        struct node* n = (struct node*)malloc(sizeof *n);
+        n->valid = 1;
+        struct node* old = __atomic_exchange_n(&shared, n, __ATOMIC_ACQ_REL);
+        defer_after_grace(retire, old);
+        defer_quiescent();
+    }
+    // both readers let grace periods pass while they are still running
+    for (int i = 0; i < 1000 && !reclaimed; ++i) {
+        defer_quiescent();
+        sched_yield();
+    }
+    assert(reclaimed);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < 2; ++i)
+        pthread_join(readers[i], NULL);
+    for (int i = 0; i < 3; ++i)
+        defer_quiescent();
+    assert(reclaimed == PER_WORKER);
+    defer_thread_unregister();
+    free(shared);
+}
+
+// rounding the blocks per pass up leaves fewer passes than workers here, 121
+// blocks over 12 workers goes in 11 passes of 11, the job must still finish
+void split(void) {
+    defer_async_workers(12);
+    hits = 0;
+    long seven = 7;
+    defer_scope_t* ds = defer_scope_begin();
+    for (int i = 0; i < 3604; ++i)
+        defer_flags(hit, &seven, DEFER_UNORDERED);
+    defer_scope_pop_async(ds);
+    defer_async_drain();
+    assert(hits == 3604);
+}
+
+static defer_checkpoint_t lazy_cp;
+
+// a checkpoint on an empty stack records the root scope deferring creates
+void* lazy_root(void* unused) {
+    if (defer_checkpoint(&lazy_cp) == 0) {
+        deferi(add, 1);
+        defer_longjmp(&lazy_cp, 1);
+    }
+    // the root scope was there at the checkpoint, it runs at thread exit
+    assert(ctr == 0);
+    return NULL;
+}
+
+void checkpoint_root(void) {
+    pthread_t t;
+    ctr = 0;
+    pthread_create(&t, NULL, lazy_root, NULL);
+    pthread_join(t, NULL);
+    assert(ctr == 1);
+}
+
+// running a scope's entries, by clearing or popping it, leaves it ordered
+void unordered_reset(void) {
+    long seven = 7;
+    defer_scope_t s;
+    defer_scope_push(defer_scope_init(&s));
+    defer_flags(hit, &seven, DEFER_UNORDERED);
+    assert(s.flags & DEFER_SCOPE_UNORDERED);
+    defer_scope_clear(&s);
+    assert(!(s.flags & DEFER_SCOPE_UNORDERED));
+    defer_flags(hit, &seven, DEFER_UNORDERED);
+    defer_scope_pop(&s);
+    assert(!(s.flags & DEFER_SCOPE_UNORDERED));
+}
+
+int main(int argc, char* argv[]) {
+    fork_join();
+    depot_refill();
+    ctr = 0;
+    handoff();
+    ctr = 0;
+    thread_exit();
+    assert(forked(DEFER_FORK_RUN) == 11);
+    assert(forked(DEFER_FORK_DISCARD) == 0);
+    assert(forked(DEFER_FORK_KEEP) == 1);
+    assert(forked_in_frame() == 11);
+    defer_set_fork_policy(DEFER_FORK_DISCARD);
+    exited(DEFER_EXIT_RUN, "mxmx");
+    exited(DEFER_EXIT_FAST, "xx");
+    defer_set_fork_policy(DEFER_FORK_RUN);
+    grace();
+    async();
+    split();
+    unordered_reset();
+    checkpoint_root();
+    return 0;
+}
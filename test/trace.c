@@ -0,0 +1,120 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <defer.h>
+
+static int ran = 0;
+static int entered = 0;
+static int exited = 0;
+static const defer_site_t* last = NULL;
+
+void count(void* p) {
+    ran += (int)(intptr_t)p;
+}
+
+void count_noarg(void) {
+    ran++;
+}
+
+void count_span(void* p) {
+    ran += *(int*)p;
+}
+
+static void enter(const defer_site_t* site, void* ctx) {
+    assert(ctx == &entered);
+    entered++;
+    last = site;
+}
+
+static void leave(const defer_site_t* site, void* ctx) {
+    (void)ctx;
+    assert(site == last);
+    exited++;
+}
+
+int main(int argc, char* argv[]) {
+    defer_hooks_t hooks = {.enter = enter, .exit = leave, .ctx = &entered};
+    defer_set_hooks(&hooks);
+
+    defer_scope_t s;
+    defer_scope_push(defer_scope_init(&s));
+    int line = __LINE__ + 1;
+    defer(count, (void*)1);
+    defer_scope_pop(&s);
+    assert(ran == 1 && entered == 1 && exited == 1);
+    assert(last->line == line);
+    assert(strcmp(last->callback, "count") == 0);
+    assert(strcmp(last->func, "main") == 0);
+    assert(strstr(last->file, "trace.c"));
+
+    defer_scope_push(defer_scope_init(&s));
+    defer_noarg(count_noarg);
+    defer_handle_t h = defer_cancelable(count, (void*)100);
+    int two = 2;
+    defer_payload(count_span, &two, sizeof two);
+    defer_cancel(h);
+    defer_scope_pop(&s);
+    // canceled defers are not reported
+    assert(ran == 4 && entered == 3 && exited == 3);
+    assert(strcmp(last->callback, "count_noarg") == 0);
+
+    // a defer registered through a pointer has no site
+    void (*indirect)(deferable_free_like, void*) = defer;
+    defer_scope_push(defer_scope_init(&s));
+    indirect(count, (void*)1);
+    defer_scope_pop(&s);
+    assert(ran == 5 && last->line == 0);
+
+    // nor does one after a registration that deferred nothing
+    pthread_mutexattr_t attr;
+    pthread_mutex_t m;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    pthread_mutex_init(&m, &attr);
+    pthread_mutex_lock(&m);
+    defer_scope_push(defer_scope_init(&s));
+    assert(defer_lock(&m) != 0);
+    indirect(count, (void*)1);
+    defer_scope_pop(&s);
+    assert(ran == 6 && last->line == 0);
+    defer_scope_push(defer_scope_init(&s));
+    defer_many(count, NULL, 0);
+    indirect(count, (void*)1);
+    defer_scope_pop(&s);
+    assert(ran == 7 && last->line == 0);
+    pthread_mutex_unlock(&m);
+    pthread_mutex_destroy(&m);
+
+    defer_set_hooks(NULL);
+    defer_scope_push(defer_scope_init(&s));
+    defer(count, (void*)1);
+    defer_scope_pop(&s);
+    assert(ran == 8 && entered == 6);
+
+    const char* path = "trace_test.json";
+    assert(defer_trace_chrome_open(path));
+    defer_scope_push(defer_scope_init(&s));
+    defer(count, (void*)1);
+    defer(count, (void*)1);
+    defer_scope_pop(&s);
+    defer_trace_chrome_close();
+    FILE* f = fopen(path, "r");
+    assert(f);
+    char buf[4096];
+    size_t n = fread(buf, 1, sizeof buf - 1, f);
+    buf[n] = 0;
+    fclose(f);
+    remove(path);
+    assert(buf[0] == '[' && strstr(buf, "\n]\n"));
+    assert(strstr(buf, "\"name\":\"count\""));
+    assert(strstr(buf, "\"ph\":\"X\""));
+    assert(strstr(buf, "\"func\":\"main\""));
+    assert(entered == 6);
+
+    return ran - 10;
+}
@@ -0,0 +1,143 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <defer_typed.h>
+
+int ctr = 0;
+
+void add_scaled(int n, short scale, const char* tag) {
+    assert(tag[0] == 't');
+    ctr += n * scale;
+}
+
+DEFER_FUNCTION(defer_add_scaled, add_scaled, (int, n, short, scale,
+                                              const char*, tag));
+
+static bool fd_open(int fd) {
+    return fcntl(fd, F_GETFD) != -1 || errno != EBADF;
+}
+
+#define BATCH 100
+
+int batch[BATCH];
+
+// registered first, so it runs after every batched close
+void all_closed(void* unused) {
+    for (int i = 0; i < BATCH; ++i)
+        assert(!fd_open(batch[i]));
+}
+
+// a callback between closes splits the run, the later closes already ran
+void half_closed(void* unused) {
+    for (int i = 0; i < BATCH; ++i)
+        assert(fd_open(batch[i]) == (i < BATCH / 2));
+}
+
+static bool mapped(char* p, size_t page) {
+    unsigned char v;
+    return mincore(p, page, &v) == 0;
+}
+
+int main(int argc, char* argv[]) {
+    pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+    int fds[2];
+    assert(pipe(fds) == 0);
+
+    defer_scope_t s;
+    defer_scope_push(defer_scope_init(&s));
+    defer_add_scaled(3, 2, "typed");
+    defer_add_scaled(1, 1, "trampoline");
+    defer_fclose(tmpfile());
+    defer_close_fd(fds[0]);
+    pthread_mutex_lock(&m);
+    defer_mutex_unlock(&m);
+    defer_scope_pop(&s);
+    assert(ctr == 7);
+    assert(!fd_open(fds[0]));
+    assert(pthread_mutex_trylock(&m) == 0);
+    pthread_mutex_unlock(&m);
+
+    defer_scope_push(defer_scope_init(&s));
+    pthread_mutex_lock(&m);
+    defer_mutex_unlock(&m);
+    // the unlock is the same entry defer_lock stores, not a trampoline
+    assert((s.routines[0].kind & DEFER_KIND_MASK) == DEFER_KIND_MUTEX);
+    defer_scope_pop(&s);
+    assert(pthread_mutex_trylock(&m) == 0);
+    pthread_mutex_unlock(&m);
+
+    defer_scope_push(defer_scope_init(&s));
+    defer_release(fds[1]);
+    // descriptors go in as close entries, to batch with defer_close
+    assert((s.routines[0].kind & DEFER_KIND_MASK) == DEFER_KIND_CLOSE);
+    defer_release(tmpfile());
+    defer_release(malloc(16));
+    defer_release((char*)malloc(16));
+    pthread_mutex_lock(&m);
+    defer_release(&m);
+    defer_scope_pop(&s);
+    assert(!fd_open(fds[1]));
+    assert(pthread_mutex_trylock(&m) == 0);
+    pthread_mutex_unlock(&m);
+
+    assert(pipe(fds) == 0);
+    {
+        DEFER_AUTO_FREE char* buf = malloc(16);
+        DEFER_AUTO_FCLOSE FILE* f = tmpfile();
+        DEFER_AUTO_CLOSE int fd = fds[0];
+        DEFER_AUTO_CLOSE int none = -1;
+        pthread_mutex_lock(&m);
+        DEFER_AUTO_UNLOCK(&m);
+        assert(buf && f && fd >= 0 && none < 0);
+    }
+    assert(!fd_open(fds[0]));
+    assert(pthread_mutex_trylock(&m) == 0);
+    pthread_mutex_unlock(&m);
+    close(fds[1]);
+
+    // descriptors dup'd in order come out contiguous, shuffle them anyway
+    defer_scope_push(defer_scope_init(&s));
+    defer(all_closed, NULL);
+    for (int i = 0; i < BATCH; ++i)
+        batch[i] = dup(0);
+    for (int i = 0; i < BATCH / 2; ++i)
+        defer_close(batch[(i * 7) % (BATCH / 2)]);
+    defer(half_closed, NULL);
+    for (int i = BATCH / 2; i < BATCH; ++i)
+        defer_close(batch[BATCH - 1 - i + BATCH / 2]);
+    defer_scope_pop(&s);
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char* map = (char*)mmap(NULL, 4 * page, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(map != MAP_FAILED);
+    char path[] = "/tmp/defer_typed_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    defer_scope_push(defer_scope_init(&s));
+    defer_munmap(map + 2 * page, page);
+    defer_munmap(map, 1);
+    defer_munmap(map + page, page);
+    defer_close(fd);
+    assert(defer_unlink(path) == 0);
+    char unlinked[sizeof path];
+    memcpy(unlinked, path, sizeof path);
+    path[0] = 0;
+    defer_scope_pop(&s);
+    for (int i = 0; i < 3; ++i)
+        assert(!mapped(map + i * page, page));
+    assert(mapped(map + 3 * page, page));
+    munmap(map + 3 * page, page);
+    assert(!fd_open(fd));
+    assert(access(unlinked, F_OK) == -1 && errno == ENOENT);
+
+    return 0;
+}
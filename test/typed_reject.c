@@ -0,0 +1,8 @@
+#include <defer_typed.h>
+
+// defer_release has no cleanup for a double, this must not compile
+int main(int argc, char* argv[]) {
+    double* d = malloc(sizeof(*d));
+    defer_release(*d);
+    return 0;
+}